@@ -0,0 +1,78 @@
+#include "BitParallel.hpp"
+
+namespace
+{
+typedef BitParallel::Positions Positions;
+
+unsigned countPositions(const Nfa& nfa)
+{
+    unsigned out = 0;
+    for (auto& transition : nfa.transitions)
+        if (transition.chset != Nfa::Epsilon) ++out;
+    return out;
+}
+
+} //namespace
+
+const unsigned BitParallel::MaxPositions;
+
+bool fitsBitParallel(const Nfa& nfa)
+{
+    return countPositions(nfa) <= BitParallel::MaxPositions;
+}
+
+BitParallel compileBitParallel(const Nfa& nfa)
+{
+    BitParallel out;
+    out.classes = partitionAlphabet(nfa);
+
+    std::vector<unsigned> positionOf(nfa.transitions.size(), 0);
+    std::vector<unsigned> transitionOf;
+    for (unsigned i = 0; i < nfa.transitions.size(); ++i)
+    {
+        if (nfa.transitions[i].chset == Nfa::Epsilon) continue;
+        positionOf[i] = transitionOf.size();
+        transitionOf.push_back(i);
+    }
+    auto armed = [&](const NfaStateIds& ids)
+        {
+            Positions positions = 0;
+            for (auto id : ids)
+                for (unsigned i = nfa.states[id].transitionsBegin; i < nfa.states[id].transitionsEnd; ++i)
+                    if (nfa.transitions[i].chset != Nfa::Epsilon) positions |= Positions(1) << positionOf[i];
+            return positions;
+        };
+
+    int tags = -1;
+    for (auto& state : nfa.states) tags = std::max(tags, state.tag);
+    out.accepting.assign(tags + 1, 0);
+    out.shiftable = 0;
+    out.live = 0;
+    for (unsigned position = 0; position < transitionOf.size(); ++position)
+    {
+        Positions bit = Positions(1) << position;
+        // transitions of unreachable states may still point nowhere
+        unsigned target = nfa.transitions[transitionOf[position]].target;
+        NfaStateIds reached = (target == Nfa::NoState) ? NfaStateIds() : epsilonClosure(nfa, {target});
+        out.follow.push_back(armed(reached));
+        for (auto id : reached)
+            if (nfa.states[id].tag != NfaState::NoTag) out.accepting[nfa.states[id].tag] |= bit;
+        if (isLive(nfa, reached)) out.live |= bit;
+        if ((position + 1 < BitParallel::MaxPositions) && (out.follow.back() == (bit << 1)))
+            out.shiftable |= bit;
+    }
+    NfaStateIds starting = startStates(nfa);
+    out.start = armed(starting);
+    out.startLive = not starting.empty();
+
+    for (unsigned cls = 0; cls < out.classes.count; ++cls)
+    {
+        Positions positions = 0;
+        for (unsigned position = 0; position < transitionOf.size(); ++position)
+            if (nfa.chsets[nfa.transitions[transitionOf[position]].chset].contains(out.classes.representative[cls]))
+                positions |= Positions(1) << position;
+        out.classMatches.push_back(positions);
+    }
+    for (unsigned c = 0; c < 256; ++c) out.byteMatches[c] = out.classMatches[out.classes.byteClass[c]];
+    return out;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Nfa.hpp"
+#include "CharClasses.hpp"
+#include <vector>
+
+// shift-and simulation of the position automaton of an nfa with at most
+// 64 non-epsilon transitions; a state is the mask of positions which may
+// take the next character, positions following their predecessor are
+// advanced with a single shift
+struct BitParallel
+{
+    typedef uint64_t Positions;
+    static const unsigned MaxPositions = 64;
+
+    CharClasses classes;
+    Positions byteMatches[256];
+    std::vector<Positions> classMatches;
+    std::vector<Positions> follow;
+    std::vector<Positions> accepting;
+    Positions shiftable;
+    Positions live;
+    Positions start;
+    bool startLive;
+
+    Positions matching(uint64_t c) const
+    {
+        if (c < 256) return byteMatches[c];
+        return classMatches[classes.intervalOf(c)];
+    }
+    Positions next(Positions matched) const
+    {
+        Positions out = (matched & shiftable) << 1;
+        for (Positions rest = matched & ~shiftable; rest != 0; rest &= rest - 1)
+            out |= follow[__builtin_ctzll(rest)];
+        return out;
+    }
+    int acceptedTag(Positions matched) const
+    {
+        for (unsigned tag = accepting.size(); tag-- > 0;)
+            if (matched & accepting[tag]) return tag;
+        return NfaState::NoTag;
+    }
+};
+
+// bumped whenever compileBitParallel builds other tables from the same nfa
+const unsigned BitParallelRevision = 1;
+
+bool fitsBitParallel(const Nfa& nfa);
+BitParallel compileBitParallel(const Nfa& nfa);
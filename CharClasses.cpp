@@ -0,0 +1,53 @@
+#include "CharClasses.hpp"
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+
+unsigned CharClasses::intervalOf(uint64_t c) const
+{
+    auto it = std::upper_bound(boundaries.begin(), boundaries.end(), c);
+    return intervalClass[it - boundaries.begin() - 1];
+}
+
+CharClasses partitionAlphabet(const Nfa& nfa)
+{
+    const std::vector<Chset>& chsets = nfa.chsets;
+    std::set<uint64_t> points = {0};
+    for (auto& chset : chsets)
+    {
+        for (auto range : chset.ranges)
+        {
+            if (range.first > range.second) continue;
+            points.insert(range.first);
+            if (range.second != std::numeric_limits<uint64_t>::max())
+                points.insert(range.second + 1);
+        }
+    }
+
+    CharClasses out;
+    out.boundaries.assign(points.begin(), points.end());
+    std::map<std::vector<bool>, unsigned> signatures;
+    std::vector<CharRanges::const_iterator> cursors;
+    for (auto& chset : chsets) cursors.push_back(chset.ranges.begin());
+    for (auto boundary : out.boundaries)
+    {
+        std::vector<bool> signature(chsets.size(), false);
+        for (unsigned i = 0; i < chsets.size(); ++i)
+        {
+            auto& cursor = cursors[i];
+            while ((cursor != chsets[i].ranges.end()) && (cursor->second < boundary)) ++cursor;
+            signature[i] = (cursor != chsets[i].ranges.end()) && (cursor->first <= boundary);
+        }
+        auto it = signatures.find(signature);
+        if (it == signatures.end())
+        {
+            it = signatures.insert({signature, out.representative.size()}).first;
+            out.representative.push_back(boundary);
+        }
+        out.intervalClass.push_back(it->second);
+    }
+    out.count = out.representative.size();
+    for (unsigned c = 0; c < 256; ++c) out.byteClass[c] = out.intervalOf(c);
+    return out;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Nfa.hpp"
+#include <vector>
+
+// partition of the alphabet into classes of characters which no chset
+// of an automaton can tell apart; intervals are given by their lower bounds
+struct CharClasses
+{
+    std::vector<uint64_t> boundaries;
+    std::vector<unsigned> intervalClass;
+    std::vector<uint64_t> representative;
+    unsigned byteClass[256];
+    unsigned count;
+
+    unsigned classOf(uint64_t c) const
+    {
+        if (c < 256) return byteClass[c];
+        return intervalOf(c);
+    }
+    unsigned intervalOf(uint64_t c) const;
+};
+
+CharClasses partitionAlphabet(const Nfa& nfa);
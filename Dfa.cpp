@@ -0,0 +1,477 @@
+#include "Dfa.hpp"
+#include <map>
+#include <algorithm>
+
+namespace
+{
+typedef std::pair<const CharRanges*, unsigned> Move;
+typedef std::vector<Move> Moves;
+
+struct SubsetConstruction
+{
+    const Nfa& nfa;
+    const unsigned maxStates;
+    std::map<NfaStateIds, unsigned> known;
+    std::vector<NfaStateIds> sets;
+    SparseSet reached;
+    Dfa::Rows rows;
+    Dfa dfa;
+
+    SubsetConstruction(const Nfa& nfa, unsigned maxStates)
+        : nfa(nfa), maxStates(maxStates), reached(nfa.states.size())
+    {
+        dfa.classes = partitionAlphabet(nfa);
+        dfa.stride = dfa.classes.count;
+        stateFor({});
+    }
+
+    unsigned stateFor(const NfaStateIds& ids)
+    {
+        auto it = known.find(ids);
+        if (it != known.end()) return it->second;
+        unsigned id = sets.size();
+        if (id >= maxStates) throw DfaLimitExceeded();
+        known[ids] = id;
+        sets.push_back(ids);
+        dfa.accepting.push_back(acceptedTag(nfa, ids));
+        dfa.live.push_back(isLive(nfa, ids));
+        return id;
+    }
+
+    Moves movesFrom(const NfaStateIds& ids)
+    {
+        Moves out;
+        for (auto id : ids)
+        {
+            const NfaState& state = nfa.states[id];
+            for (unsigned i = state.transitionsBegin; i < state.transitionsEnd; ++i)
+            {
+                const NfaTransition& transition = nfa.transitions[i];
+                if (transition.chset == Nfa::Epsilon) continue;
+                out.push_back(Move(&nfa.chsets[transition.chset].ranges, transition.target));
+            }
+        }
+        return out;
+    }
+
+    void expand(unsigned id)
+    {
+        Moves moves = movesFrom(sets[id]);
+        std::vector<CharRanges::const_iterator> cursors;
+        for (auto move : moves) cursors.push_back(move.first->begin());
+
+        const CharClasses& classes = dfa.classes;
+        std::vector<bool> done(classes.count, false);
+        unsigned rowBegin = rows.size();
+        rows.resize(rowBegin + classes.count, Dfa::Dead);
+        for (unsigned interval = 0; interval < classes.boundaries.size(); ++interval)
+        {
+            unsigned cls = classes.intervalClass[interval];
+            uint64_t boundary = classes.boundaries[interval];
+            reached.clear();
+            for (unsigned i = 0; i < moves.size(); ++i)
+            {
+                auto& cursor = cursors[i];
+                while ((cursor != moves[i].first->end()) && (cursor->second < boundary)) ++cursor;
+                if (not done[cls] && (cursor != moves[i].first->end()) && (cursor->first <= boundary))
+                    addClosure(nfa, moves[i].second, reached);
+            }
+            if (done[cls]) continue;
+            done[cls] = true;
+            rows[rowBegin + cls] = stateFor(sortedIds(reached));
+        }
+    }
+
+    Dfa run()
+    {
+        dfa.start = stateFor(startStates(nfa));
+        for (unsigned id = 0; id < sets.size(); ++id) expand(id);
+        dfa.table = std::move(rows);
+        return dfa;
+    }
+};
+
+struct Minimization
+{
+    const Dfa& dfa;
+    const unsigned n;
+    const unsigned k;
+    std::vector<unsigned> predecessorsBegin;
+    std::vector<unsigned> predecessors;
+    std::vector<unsigned> blockOf;
+    std::vector<std::vector<unsigned>> blocks;
+    std::vector<unsigned> worklist;
+    std::vector<bool> inWorklist;
+
+    Minimization(const Dfa& dfa) : dfa(dfa), n(dfa.size()), k(dfa.classes.count), blockOf(n)
+    {
+        predecessorsBegin.assign(n * k + 1, 0);
+        for (unsigned state = 0; state < n; ++state)
+            for (unsigned cls = 0; cls < k; ++cls)
+                ++predecessorsBegin[cls * n + target(state, cls) + 1];
+        for (unsigned i = 1; i < predecessorsBegin.size(); ++i)
+            predecessorsBegin[i] += predecessorsBegin[i - 1];
+        predecessors.resize(n * k);
+        std::vector<unsigned> filled(predecessorsBegin.begin(), predecessorsBegin.end() - 1);
+        for (unsigned state = 0; state < n; ++state)
+            for (unsigned cls = 0; cls < k; ++cls)
+                predecessors[filled[cls * n + target(state, cls)]++] = state;
+
+        std::map<std::pair<int, bool>, unsigned> initial;
+        for (unsigned state = 0; state < n; ++state)
+        {
+            auto key = std::make_pair(dfa.accepting[state], bool(dfa.live[state]));
+            auto it = initial.find(key);
+            if (it == initial.end()) it = initial.insert({key, createBlock()}).first;
+            blockOf[state] = it->second;
+            blocks[it->second].push_back(state);
+        }
+    }
+
+    unsigned target(unsigned state, unsigned cls) const
+    {
+        return dfa.transition(state, cls) & Dfa::TargetMask;
+    }
+
+    unsigned createBlock()
+    {
+        blocks.push_back({});
+        worklist.push_back(blocks.size() - 1);
+        inWorklist.push_back(true);
+        return blocks.size() - 1;
+    }
+
+    void refine()
+    {
+        std::vector<bool> marked(n, false);
+        std::vector<unsigned> markedCount(n, 0);
+        while (not worklist.empty())
+        {
+            unsigned splitter = worklist.back();
+            worklist.pop_back();
+            inWorklist[splitter] = false;
+            std::vector<unsigned> splitterStates = blocks[splitter];
+            for (unsigned cls = 0; cls < k; ++cls)
+            {
+                std::vector<unsigned> preimage;
+                std::vector<unsigned> touched;
+                for (auto target : splitterStates)
+                {
+                    unsigned begin = predecessorsBegin[cls * n + target];
+                    unsigned end = predecessorsBegin[cls * n + target + 1];
+                    for (unsigned i = begin; i < end; ++i)
+                    {
+                        unsigned state = predecessors[i];
+                        if (marked[state]) continue;
+                        marked[state] = true;
+                        preimage.push_back(state);
+                        if (markedCount[blockOf[state]]++ == 0) touched.push_back(blockOf[state]);
+                    }
+                }
+                for (auto block : touched)
+                {
+                    if (markedCount[block] < blocks[block].size()) split(block, marked);
+                    markedCount[block] = 0;
+                }
+                for (auto state : preimage) marked[state] = false;
+            }
+        }
+    }
+
+    void split(unsigned block, const std::vector<bool>& marked)
+    {
+        std::vector<unsigned> kept;
+        std::vector<unsigned> moved;
+        for (auto state : blocks[block])
+            (marked[state] ? moved : kept).push_back(state);
+        bool wasQueued = inWorklist[block];
+        unsigned created = createBlock();
+        blocks[block] = kept;
+        blocks[created] = moved;
+        for (auto state : moved) blockOf[state] = created;
+        if (not wasQueued && (kept.size() < moved.size()))
+        {
+            worklist.back() = block;
+            inWorklist[block] = true;
+            inWorklist[created] = false;
+        }
+    }
+
+    Dfa run()
+    {
+        refine();
+        std::vector<unsigned> renumbered(blocks.size(), n);
+        std::vector<unsigned> representatives;
+        for (unsigned state = 0; state < n; ++state)
+        {
+            if (renumbered[blockOf[state]] != n) continue;
+            renumbered[blockOf[state]] = representatives.size();
+            representatives.push_back(state);
+        }
+
+        Dfa out;
+        out.classes = dfa.classes;
+        out.stride = k;
+        out.start = renumbered[blockOf[dfa.start]];
+        Dfa::Rows rows;
+        for (auto state : representatives)
+        {
+            out.accepting.push_back(dfa.accepting[state]);
+            out.live.push_back(dfa.live[state]);
+            for (unsigned cls = 0; cls < k; ++cls)
+                rows.push_back(renumbered[blockOf[target(state, cls)]]);
+        }
+        out.table = std::move(rows);
+        mergeClasses(out);
+        return out;
+    }
+
+    // classes whose columns became identical are not distinguished any more
+    void mergeClasses(Dfa& out)
+    {
+        std::map<std::vector<unsigned>, unsigned> columns;
+        std::vector<unsigned> merged(k);
+        for (unsigned cls = 0; cls < k; ++cls)
+        {
+            std::vector<unsigned> column;
+            for (unsigned state = 0; state < out.size(); ++state)
+                column.push_back(out.table[state * k + cls]);
+            merged[cls] = columns.insert({column, columns.size()}).first->second;
+        }
+        if (columns.size() == k) return;
+
+        CharClasses& classes = out.classes;
+        std::vector<uint64_t> representative(columns.size());
+        for (unsigned cls = k; cls-- > 0;) representative[merged[cls]] = classes.representative[cls];
+        classes.representative = representative;
+        classes.count = columns.size();
+        for (auto& cls : classes.byteClass) cls = merged[cls];
+        std::vector<uint64_t> boundaries;
+        std::vector<unsigned> intervalClass;
+        for (unsigned interval = 0; interval < classes.boundaries.size(); ++interval)
+        {
+            unsigned cls = merged[classes.intervalClass[interval]];
+            if (not intervalClass.empty() && (intervalClass.back() == cls)) continue;
+            boundaries.push_back(classes.boundaries[interval]);
+            intervalClass.push_back(cls);
+        }
+        classes.boundaries = boundaries;
+        classes.intervalClass = intervalClass;
+
+        Dfa::Rows rows(out.size() * classes.count);
+        for (unsigned state = 0; state < out.size(); ++state)
+            for (unsigned cls = 0; cls < k; ++cls)
+                rows[state * classes.count + merged[cls]] = out.table[state * k + cls];
+        out.table = std::move(rows);
+        out.stride = classes.count;
+    }
+};
+
+unsigned paddedStride(unsigned count)
+{
+    const unsigned lineEntries = CacheAligned<unsigned>::LineSize / sizeof(unsigned);
+    if (count > lineEntries) return count;
+    unsigned out = 1;
+    while (out < count) out *= 2;
+    return out;
+}
+
+const unsigned Unnumbered = -1;
+
+struct Layout
+{
+    const Dfa& dfa;
+    const std::vector<unsigned long>& visits;
+    std::vector<unsigned> order;
+    std::vector<unsigned> renumbered;
+
+    Layout(const Dfa& dfa, const std::vector<unsigned long>& visits)
+        : dfa(dfa), visits(visits), renumbered(dfa.size(), Unnumbered) {}
+
+    void visit(unsigned state)
+    {
+        if (renumbered[state] != Unnumbered) return;
+        renumbered[state] = order.size();
+        order.push_back(state);
+    }
+
+    void breadthFirst()
+    {
+        visit(Dfa::Dead);
+        visit(dfa.start);
+        for (unsigned i = 0; i < order.size(); ++i)
+            for (unsigned cls = 0; cls < dfa.classes.count; ++cls)
+                visit(dfa.transition(order[i], cls) & Dfa::TargetMask);
+        for (unsigned state = 0; state < dfa.size(); ++state) visit(state);
+    }
+
+    void byVisits()
+    {
+        std::stable_sort(order.begin() + 1, order.end(), [&](unsigned left, unsigned right) {
+            return visits[left] > visits[right];
+        });
+        for (unsigned i = 0; i < order.size(); ++i) renumbered[order[i]] = i;
+    }
+
+    Dfa run()
+    {
+        breadthFirst();
+        if (visits.size() == dfa.size()) byVisits();
+
+        Dfa out;
+        out.classes = dfa.classes;
+        out.stride = paddedStride(dfa.classes.count);
+        for (auto state : order)
+        {
+            out.accepting.push_back(dfa.accepting[state]);
+            out.live.push_back(dfa.live[state]);
+        }
+        out.start = renumbered[dfa.start];
+        Dfa::Rows rows(out.size() * out.stride, out.entryOf(Dfa::Dead));
+        for (unsigned state = 0; state < out.size(); ++state)
+            for (unsigned cls = 0; cls < dfa.classes.count; ++cls)
+                rows[state * out.stride + cls]
+                    = out.entryOf(renumbered[dfa.transition(order[state], cls) & Dfa::TargetMask]);
+        out.table = std::move(rows);
+        return out;
+    }
+};
+
+// first fit of the rows, the ones with most transitions placed first
+template <typename Id>
+Dfa::Packed<Id> packRows(const Dfa& dfa)
+{
+    const unsigned k = dfa.classes.count;
+    std::vector<std::vector<unsigned>> used(dfa.size());
+    for (unsigned state = 0; state < dfa.size(); ++state)
+        for (unsigned cls = 0; cls < k; ++cls)
+            if ((dfa.transition(state, cls) & Dfa::TargetMask) != Dfa::Dead) used[state].push_back(cls);
+    std::vector<unsigned> order(dfa.size());
+    for (unsigned state = 0; state < dfa.size(); ++state) order[state] = state;
+    std::stable_sort(order.begin(), order.end(), [&](unsigned left, unsigned right) {
+        return used[left].size() > used[right].size();
+    });
+
+    std::vector<unsigned> bases(dfa.size(), 0);
+    std::vector<Id> targets;
+    std::vector<Id> checks;
+    for (auto state : order)
+    {
+        if (used[state].empty()) continue;
+        unsigned base = 0;
+        for (;; ++base)
+        {
+            bool fits = true;
+            for (auto cls : used[state])
+                if ((base + cls < checks.size()) && (checks[base + cls] != Dfa::Packed<Id>::Free))
+                {
+                    fits = false;
+                    break;
+                }
+            if (fits) break;
+        }
+        bases[state] = base;
+        if (checks.size() < base + k)
+        {
+            checks.resize(base + k, Dfa::Packed<Id>::Free);
+            targets.resize(base + k, Dfa::Dead);
+        }
+        for (auto cls : used[state])
+        {
+            checks[base + cls] = state;
+            targets[base + cls] = dfa.transition(state, cls) & Dfa::TargetMask;
+        }
+    }
+    if (checks.size() < k)
+    {
+        checks.resize(k, Dfa::Packed<Id>::Free);
+        targets.resize(k, Dfa::Dead);
+    }
+    Dfa::Packed<Id> out;
+    out.base = std::move(bases);
+    out.targets = std::move(targets);
+    out.checks = std::move(checks);
+    return out;
+}
+
+} //namespace
+
+const unsigned Dfa::Dead;
+const unsigned Dfa::Accepts;
+const unsigned Dfa::Stops;
+const unsigned Dfa::TargetMask;
+template <typename Id>
+const Id Dfa::Packed<Id>::Free;
+
+unsigned Dfa::size() const
+{
+    return accepting.size();
+}
+
+std::size_t Dfa::transitionBytes() const
+{
+    std::size_t out = table.size() * sizeof(unsigned) + entries.size() * sizeof(unsigned);
+    return out + packed8.bytes() + packed16.bytes() + packed32.bytes();
+}
+
+std::size_t classesBytes(const CharClasses& classes)
+{
+    return sizeof(classes.byteClass) + classes.boundaries.size() * sizeof(uint64_t)
+        + classes.intervalClass.size() * sizeof(unsigned) + classes.representative.size() * sizeof(uint64_t);
+}
+
+Dfa compileDfa(const Nfa& nfa, unsigned maxStates)
+{
+    return SubsetConstruction(nfa, maxStates).run();
+}
+
+Dfa minimizeDfa(const Dfa& dfa)
+{
+    return Minimization(dfa).run();
+}
+
+Dfa layoutDfa(const Dfa& dfa, const std::vector<unsigned long>& visits)
+{
+    return Layout(dfa, visits).run();
+}
+
+Dfa packDfa(const Dfa& dfa)
+{
+    Dfa out;
+    out.classes = dfa.classes;
+    out.accepting = dfa.accepting;
+    out.live = dfa.live;
+    out.start = dfa.start;
+    out.stride = dfa.stride;
+    for (unsigned state = 0; state < out.size(); ++state) out.entries.push_back(out.entryOf(state));
+    if (dfa.size() < Dfa::Packed<uint8_t>::Free)
+    {
+        out.packed8 = packRows<uint8_t>(dfa);
+        out.idWidth = 1;
+    }
+    else if (dfa.size() < Dfa::Packed<uint16_t>::Free)
+    {
+        out.packed16 = packRows<uint16_t>(dfa);
+        out.idWidth = 2;
+    }
+    else
+    {
+        out.packed32 = packRows<uint32_t>(dfa);
+        out.idWidth = 4;
+    }
+    return out;
+}
+
+std::vector<unsigned long> profileDfa(const Dfa& dfa, const std::string& corpus)
+{
+    std::vector<unsigned long> visits(dfa.size(), 0);
+    unsigned state = dfa.start;
+    for (unsigned char c : corpus)
+    {
+        unsigned target = dfa.next(state, c);
+        if ((target == Dfa::Dead) && (state != dfa.start)) target = dfa.next(dfa.start, c);
+        state = (target == Dfa::Dead) ? dfa.start : target;
+        ++visits[state];
+    }
+    return visits;
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "Nfa.hpp"
+#include "CharClasses.hpp"
+#include <vector>
+#include <stdexcept>
+#include <limits>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <memory>
+#include <utility>
+
+// allocator placing arrays at the start of a cache line
+template <typename T>
+struct CacheAligned
+{
+    typedef T value_type;
+    static const std::size_t LineSize = 64;
+
+    CacheAligned() {}
+    template <typename U>
+    CacheAligned(const CacheAligned<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        void* out = nullptr;
+        if (posix_memalign(&out, LineSize, n * sizeof(T)) != 0) throw std::bad_alloc();
+        return static_cast<T*>(out);
+    }
+    void deallocate(T* p, std::size_t) { std::free(p); }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAligned<T>&, const CacheAligned<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const CacheAligned<T>&, const CacheAligned<U>&) { return false; }
+
+// immutable array of a dfa, either holding its elements or viewing ones
+// stored elsewhere, like the tables of a mapped snapshot, which are kept
+// alive by holder
+template <typename T, typename Allocator = std::allocator<T>>
+class Table
+{
+    std::vector<T, Allocator> owned;
+    std::shared_ptr<const void> holder;
+    const T* items;
+    std::size_t count;
+
+public:
+    Table() : items(nullptr), count(0) {}
+    Table(std::vector<T, Allocator> values) : owned(std::move(values)), items(owned.data()), count(owned.size()) {}
+    Table(const T* items, std::size_t count, std::shared_ptr<const void> holder)
+        : holder(holder), items(items), count(count)
+    {}
+    Table(const Table& other)
+        : owned(other.owned), holder(other.holder), items(holder ? other.items : owned.data()), count(other.count)
+    {}
+    Table(Table&& other) : Table() { swap(other); }
+    Table& operator=(Table other)
+    {
+        swap(other);
+        return *this;
+    }
+
+    // the buffer of a vector stays where it is when swapped
+    void swap(Table& other)
+    {
+        owned.swap(other.owned);
+        holder.swap(other.holder);
+        std::swap(items, other.items);
+        std::swap(count, other.count);
+    }
+
+    const T& operator[](std::size_t i) const { return items[i]; }
+    const T* data() const { return items; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+};
+
+// deterministic automaton compiled from nfa with the subset construction,
+// state 0 is the dead state, each state has a row of stride entries indexed
+// by character class and the tag of the definition it accepts (NfaState::NoTag
+// if none); an entry is the target state with flags telling whether the
+// target accepts and whether it stops, i.e. is not live
+struct Dfa
+{
+    static const unsigned Dead = 0;
+    static const unsigned Accepts = 1u << 31;
+    static const unsigned Stops = 1u << 30;
+    static const unsigned TargetMask = Stops - 1;
+
+    // rows overlaid by row displacement: state s owns slot base[s] + class
+    // when checks there is s, its target then is in targets, any class
+    // without a slot leads to the dead state
+    template <typename Id>
+    struct Packed
+    {
+        static const Id Free = std::numeric_limits<Id>::max();
+
+        Table<unsigned> base;
+        Table<Id> targets;
+        Table<Id> checks;
+
+        unsigned target(unsigned state, unsigned cls) const
+        {
+            unsigned slot = base[state] + cls;
+            return (checks[slot] == state) ? targets[slot] : Dead;
+        }
+        std::size_t bytes() const
+        {
+            return base.size() * sizeof(unsigned) + (targets.size() + checks.size()) * sizeof(Id);
+        }
+    };
+
+    typedef std::vector<unsigned, CacheAligned<unsigned>> Rows;
+
+    CharClasses classes;
+    // plain rows, empty when packed
+    Table<unsigned, CacheAligned<unsigned>> table;
+    unsigned stride;
+    // bytes of a packed state id, 0 when the rows are plain; only the
+    // rows of that width are filled and entries holds entryOf every state
+    unsigned idWidth;
+    Packed<uint8_t> packed8;
+    Packed<uint16_t> packed16;
+    Packed<uint32_t> packed32;
+    std::vector<unsigned> entries;
+    std::vector<int> accepting;
+    std::vector<bool> live;
+    unsigned start;
+
+    Dfa() : stride(0), idWidth(0), start(Dead) {}
+
+    unsigned transition(unsigned state, unsigned cls) const
+    {
+        switch (idWidth)
+        {
+            case 1: return entries[packed8.target(state, cls)];
+            case 2: return entries[packed16.target(state, cls)];
+            case 4: return entries[packed32.target(state, cls)];
+            default: return table[state * stride + cls];
+        }
+    }
+    unsigned entry(unsigned state, uint64_t c) const
+    {
+        return transition(state, classes.classOf(c));
+    }
+    unsigned next(unsigned state, uint64_t c) const
+    {
+        return entry(state, c) & TargetMask;
+    }
+    // state with its flags, as a transition to it is stored
+    unsigned entryOf(unsigned state) const
+    {
+        return state | ((accepting[state] != NfaState::NoTag) ? Accepts : 0) | (live[state] ? 0 : Stops);
+    }
+    unsigned size() const;
+    // memory taken by the transitions, without the character classes
+    std::size_t transitionBytes() const;
+};
+
+struct DfaLimitExceeded : std::runtime_error
+{
+    DfaLimitExceeded() : std::runtime_error("dfa state limit exceeded") {}
+};
+
+// revisions of the steps below, part of the identity of grammar snapshots:
+// bump the one of a step whenever it starts building other tables from the
+// same input, or snapshots saved before the change are still loaded
+const unsigned SubsetConstructionRevision = 1;
+const unsigned MinimizationRevision = 1;
+const unsigned LayoutRevision = 1;
+const unsigned PackingRevision = 1;
+
+Dfa compileDfa(const Nfa& nfa, unsigned maxStates = std::numeric_limits<unsigned>::max());
+
+// hopcroft minimization, keeps accepted tag and live flag of every state
+Dfa minimizeDfa(const Dfa& dfa);
+
+// renumbers the states for locality and flags the entries: the dead state
+// stays first, the others follow by descending visit count and in
+// breadth-first order from the start among equal counts (all of them when
+// visits is empty); rows short enough are padded to a power of two entries,
+// so that no row straddles two cache lines
+Dfa layoutDfa(const Dfa& dfa, const std::vector<unsigned long>& visits = {});
+// the same dfa with packed rows, ids as narrow as its size allows
+Dfa packDfa(const Dfa& dfa);
+// memory taken by the character classes
+std::size_t classesBytes(const CharClasses& classes);
+// state visits while scanning corpus, restarting from the start whenever the
+// scan dies, like a tokenizer does
+std::vector<unsigned long> profileDfa(const Dfa& dfa, const std::string& corpus);
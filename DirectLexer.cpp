@@ -0,0 +1,83 @@
+#include "DirectLexer.hpp"
+#include <map>
+
+namespace
+{
+
+std::map<uint64_t, DirectCodedGrammar>& registered()
+{
+    static std::map<uint64_t, DirectCodedGrammar> grammars;
+    return grammars;
+}
+
+void emitChar(std::ostream& out, uint64_t c)
+{
+    out << "0x" << std::hex << c << std::dec << "ull";
+}
+
+void emitState(std::ostream& out, const Dfa& dfa, unsigned state)
+{
+    const CharClasses& classes = dfa.classes;
+    out << "    case " << state << ":\n";
+    out << "        switch (c)\n";
+    out << "        {\n";
+    for (unsigned interval = 0; interval < classes.boundaries.size();)
+    {
+        unsigned target = dfa.transition(state, classes.intervalClass[interval]) & Dfa::TargetMask;
+        uint64_t low = classes.boundaries[interval];
+        while ((++interval < classes.boundaries.size())
+               && ((dfa.transition(state, classes.intervalClass[interval]) & Dfa::TargetMask) == target));
+        if (target == Dfa::Dead) continue;
+        uint64_t high = (interval < classes.boundaries.size()) ? classes.boundaries[interval] - 1 : ~uint64_t(0);
+        out << "        case ";
+        emitChar(out, low);
+        if (high != low)
+        {
+            out << " ... ";
+            emitChar(out, high);
+        }
+        out << ": return " << target << ";\n";
+    }
+    out << "        default: return 0;\n";
+    out << "        }\n";
+}
+
+} //namespace
+
+DirectCodedRegistration::DirectCodedRegistration(const DirectCodedGrammar& grammar)
+{
+    registered()[grammar.fingerprint] = grammar;
+}
+
+bool directCodedGrammarsRegistered()
+{
+    return not registered().empty();
+}
+
+const DirectCodedGrammar* findDirectCodedGrammar(uint64_t fingerprint)
+{
+    auto it = registered().find(fingerprint);
+    return (it != registered().end()) ? &it->second : nullptr;
+}
+
+void emitDirectCodedGrammar(std::ostream& out, const Dfa& dfa, uint64_t fingerprint, const std::string& name)
+{
+    out << "unsigned " << name << "Step(unsigned state, uint64_t c)\n";
+    out << "{\n";
+    out << "    switch (state)\n";
+    out << "    {\n";
+    for (unsigned state = 1; state < dfa.size(); ++state) emitState(out, dfa, state);
+    out << "    default: return 0;\n";
+    out << "    }\n";
+    out << "}\n\n";
+
+    out << "const int " << name << "Accepting[] = {";
+    for (unsigned state = 0; state < dfa.size(); ++state) out << (state ? ", " : "") << dfa.accepting[state];
+    out << "};\n";
+    out << "const bool " << name << "Live[] = {";
+    for (unsigned state = 0; state < dfa.size(); ++state) out << (state ? ", " : "") << (dfa.live[state] ? "true" : "false");
+    out << "};\n";
+    out << "DirectCodedRegistration " << name << "({";
+    emitChar(out, fingerprint);
+    out << ", " << dfa.start << ", " << name << "Step, " << name << "Accepting, " << name << "Live});\n\n";
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "Dfa.hpp"
+#include <ostream>
+#include <string>
+
+// dfa of a fixed grammar emitted by lexgen as a switch over states with a
+// switch over character ranges in each; generated grammars register
+// themselves at startup and replace compiling the grammar with the
+// same fingerprint
+struct DirectCodedGrammar
+{
+    uint64_t fingerprint;
+    unsigned start;
+    unsigned (*step)(unsigned state, uint64_t c);
+    const int* accepting;
+    const bool* live;
+};
+
+struct DirectCodedRegistration
+{
+    DirectCodedRegistration(const DirectCodedGrammar& grammar);
+};
+
+bool directCodedGrammarsRegistered();
+const DirectCodedGrammar* findDirectCodedGrammar(uint64_t fingerprint);
+void emitDirectCodedGrammar(std::ostream& out, const Dfa& dfa, uint64_t fingerprint, const std::string& name);
@@ -0,0 +1,63 @@
+#include "FirstChars.hpp"
+#include <map>
+#include <mutex>
+#include <iterator>
+
+namespace
+{
+
+// keyed weakly like compiled grammars, entries of freed rules are dropped
+// when the next dispatch is added
+std::mutex dispatchMutex;
+std::map<WeakRules, std::shared_ptr<const FirstCharDispatch>>& dispatches()
+{
+    static std::map<WeakRules, std::shared_ptr<const FirstCharDispatch>> known;
+    return known;
+}
+
+} //namespace
+
+Chset firstChars(const Nfa& nfa)
+{
+    CharRanges ranges;
+    for (auto id : startStates(nfa))
+    {
+        const NfaState& state = nfa.states[id];
+        for (unsigned i = state.transitionsBegin; i < state.transitionsEnd; ++i)
+        {
+            const NfaTransition& transition = nfa.transitions[i];
+            if (transition.chset == Nfa::Epsilon) continue;
+            const CharRanges& chset = nfa.chsets[transition.chset].ranges;
+            ranges.insert(ranges.end(), chset.begin(), chset.end());
+        }
+    }
+    return Chset(ranges);
+}
+
+Chset firstChars(const Rule& rule)
+{
+    return firstChars(createNfa(rule));
+}
+
+std::shared_ptr<const FirstCharDispatch> firstCharDispatch(const Rules& definitions)
+{
+    {
+        std::lock_guard<std::mutex> lock(dispatchMutex);
+        auto it = dispatches().find(definitions);
+        if (it != dispatches().end()) return it->second;
+    }
+    auto dispatch = std::make_shared<FirstCharDispatch>();
+    for (auto& definition : definitions)
+        dispatch->firsts.push_back(firstChars(definition));
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        dispatch->byteCandidates[c] = 0;
+        for (auto& first : dispatch->firsts)
+            if (first.contains(c)) ++dispatch->byteCandidates[c];
+    }
+    std::lock_guard<std::mutex> lock(dispatchMutex);
+    auto& known = dispatches();
+    for (auto it = known.begin(); it != known.end();)
+        it = it->first.expired() ? known.erase(it) : std::next(it);
+    return known[definitions] = dispatch;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "RegexRule.hpp"
+#include "Nfa.hpp"
+#include <memory>
+
+// characters a nonempty match of the rule can start with
+Chset firstChars(const Nfa& nfa);
+Chset firstChars(const Rule& rule);
+
+// which token definitions can start with a character: a table for bytes,
+// the first characters of every definition above that
+struct FirstCharDispatch
+{
+    std::vector<Chset> firsts;
+    unsigned byteCandidates[256];
+
+    unsigned candidates(uint64_t c) const
+    {
+        if (c < 256) return byteCandidates[c];
+        unsigned out = 0;
+        for (auto& first : firsts)
+            if (first.contains(c)) ++out;
+        return out;
+    }
+};
+
+// shared by all tokenizers built from the same definitions
+std::shared_ptr<const FirstCharDispatch> firstCharDispatch(const Rules& definitions);
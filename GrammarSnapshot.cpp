@@ -0,0 +1,398 @@
+#include "GrammarSnapshot.hpp"
+#include "RuleNormalization.hpp"
+#include "StateMachine.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+const char Magic[8] = {'C', 'P', 'P', 'G', 'M', 'G', 'S', '\0'};
+// revision of the table format, part of the build identity with the
+// compiler, the revisions of the steps building the tables and the
+// parameters they depend on
+const uint32_t Version = 5;
+
+enum class Engine : uint32_t
+{
+    Dfa = 1,
+    BitParallel = 2
+};
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t engine;
+    uint64_t fingerprint;
+    uint64_t build;
+    uint64_t size;
+    // hash of everything after the header, verified on loading only with
+    // CPPGM_GRAMMAR_SNAPSHOT_CHECK set since it reads every page
+    uint64_t checksum;
+};
+
+struct MalformedSnapshot {};
+
+uint64_t hashBytes(const char* data, uint64_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    for (uint64_t i = 0; i < size; ++i)
+    {
+        hash ^= uint8_t(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+uint64_t buildIdentity()
+{
+    std::ostringstream identity;
+    identity << __VERSION__ << ' ' << Version << ' ' << sizeof(unsigned) << ' ' << Dfa::Accepts << ' '
+             << Dfa::Stops << ' ' << Dfa::Dead << ' ' << BitParallel::MaxPositions << ' '
+             << CacheAligned<unsigned>::LineSize << ' ' << NormalizationRevision << ' '
+             << NfaConstructionRevision << ' ' << BitParallelRevision << ' ' << SubsetConstructionRevision << ' '
+             << MinimizationRevision << ' ' << LayoutRevision << ' ' << PackingRevision << ' '
+             << StateMachine::maxDfaStates << ' '
+             << hashBytes(StateMachine::dfaProfile.data(), StateMachine::dfaProfile.size());
+    std::string text = identity.str();
+    return hashBytes(text.data(), text.size());
+}
+
+uint64_t payloadChecksum(const char* data, uint64_t size)
+{
+    return hashBytes(data + sizeof(Header), size - sizeof(Header));
+}
+
+bool checkingPayloads()
+{
+    return std::getenv("CPPGM_GRAMMAR_SNAPSHOT_CHECK") != nullptr;
+}
+
+// the mapping is unmapped with the last table viewing it
+std::shared_ptr<const char> mapFile(const std::string& path, uint64_t& size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || (uint64_t(info.st_size) < sizeof(Header)))
+    {
+        close(fd);
+        return nullptr;
+    }
+    size = info.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return nullptr;
+    return std::shared_ptr<const char>(static_cast<const char*>(mapped), [size](const char* data) {
+        munmap(const_cast<char*>(data), size);
+    });
+}
+
+// arrays are stored as their length followed by the elements, padded to 8
+// bytes; the elements of tables start at the given alignment in the file,
+// so that they keep it when mapped
+struct Writer
+{
+    std::string data;
+
+    void align(uint64_t alignment)
+    {
+        data.append((alignment - data.size() % alignment) % alignment, '\0');
+    }
+
+    template <typename T>
+    void value(const T& value)
+    {
+        array(&value, 1, false);
+    }
+    template <typename T>
+    void array(const T* values, uint64_t count, bool withCount = true)
+    {
+        if (withCount) value(count);
+        data.append(reinterpret_cast<const char*>(values), count * sizeof(T));
+        data.append((8 - data.size() % 8) % 8, '\0');
+    }
+    template <typename T, typename Allocator>
+    void vector(const std::vector<T, Allocator>& values)
+    {
+        array(values.data(), values.size());
+    }
+    template <typename T, typename Allocator>
+    void table(const Table<T, Allocator>& values, uint64_t alignment = 8)
+    {
+        value(uint64_t(values.size()));
+        align(alignment);
+        array(values.data(), values.size(), false);
+    }
+    void bits(const std::vector<bool>& values)
+    {
+        vector(std::vector<uint8_t>(values.begin(), values.end()));
+    }
+    void classes(const CharClasses& classes)
+    {
+        vector(classes.boundaries);
+        vector(classes.intervalClass);
+        vector(classes.representative);
+        array(classes.byteClass, 256);
+        value(classes.count);
+    }
+};
+
+// tables are read in place, viewing the mapping
+struct Reader
+{
+    std::shared_ptr<const char> mapping;
+    const char* data;
+    uint64_t size;
+    uint64_t offset;
+
+    void align(uint64_t alignment)
+    {
+        offset += (alignment - offset % alignment) % alignment;
+        if (offset > size) throw MalformedSnapshot();
+    }
+
+    const char* take(uint64_t bytes)
+    {
+        if (bytes > size - offset) throw MalformedSnapshot();
+        const char* out = data + offset;
+        offset += bytes + (8 - bytes % 8) % 8;
+        if (offset > size) offset = size;
+        return out;
+    }
+    template <typename T>
+    T value()
+    {
+        T out;
+        std::memcpy(&out, take(sizeof(T)), sizeof(T));
+        return out;
+    }
+    template <typename T>
+    std::vector<T> vector()
+    {
+        uint64_t count = value<uint64_t>();
+        if (count > (size - offset) / sizeof(T)) throw MalformedSnapshot();
+        const T* values = reinterpret_cast<const T*>(take(count * sizeof(T)));
+        return std::vector<T>(values, values + count);
+    }
+    template <typename T, typename Allocator = std::allocator<T>>
+    Table<T, Allocator> table(uint64_t alignment = 8)
+    {
+        uint64_t count = value<uint64_t>();
+        align(alignment);
+        if (count > (size - offset) / sizeof(T)) throw MalformedSnapshot();
+        const T* values = reinterpret_cast<const T*>(take(count * sizeof(T)));
+        return Table<T, Allocator>(values, count, mapping);
+    }
+    std::vector<bool> bits()
+    {
+        std::vector<uint8_t> values = vector<uint8_t>();
+        return std::vector<bool>(values.begin(), values.end());
+    }
+    void array(unsigned* out, uint64_t count)
+    {
+        if (value<uint64_t>() != count) throw MalformedSnapshot();
+        std::memcpy(out, take(count * sizeof(unsigned)), count * sizeof(unsigned));
+    }
+    void array(uint64_t* out, uint64_t count)
+    {
+        if (value<uint64_t>() != count) throw MalformedSnapshot();
+        std::memcpy(out, take(count * sizeof(uint64_t)), count * sizeof(uint64_t));
+    }
+    CharClasses classes()
+    {
+        CharClasses out;
+        out.boundaries = vector<uint64_t>();
+        out.intervalClass = vector<unsigned>();
+        out.representative = vector<uint64_t>();
+        array(out.byteClass, 256);
+        out.count = value<unsigned>();
+        if (out.boundaries.empty() || (out.boundaries.size() != out.intervalClass.size())) throw MalformedSnapshot();
+        for (auto cls : out.intervalClass) if (cls >= out.count) throw MalformedSnapshot();
+        for (auto cls : out.byteClass) if (cls >= out.count) throw MalformedSnapshot();
+        return out;
+    }
+};
+
+template <typename Id>
+void writePacked(Writer& writer, const Dfa::Packed<Id>& packed)
+{
+    writer.table(packed.base);
+    writer.table(packed.targets);
+    writer.table(packed.checks);
+}
+
+template <typename Id>
+Dfa::Packed<Id> readPacked(Reader& reader, const Dfa& dfa)
+{
+    Dfa::Packed<Id> out;
+    out.base = reader.table<unsigned>();
+    out.targets = reader.table<Id>();
+    out.checks = reader.table<Id>();
+    if ((out.base.size() != dfa.size()) || (out.targets.size() != out.checks.size())) throw MalformedSnapshot();
+    for (auto base : out.base)
+        if (uint64_t(base) + dfa.classes.count > out.checks.size()) throw MalformedSnapshot();
+    for (unsigned slot = 0; slot < out.checks.size(); ++slot)
+        if ((out.checks[slot] != Dfa::Packed<Id>::Free)
+            && ((out.checks[slot] >= dfa.size()) || (out.targets[slot] >= dfa.size())))
+            throw MalformedSnapshot();
+    return out;
+}
+
+void writeDfa(Writer& writer, const Dfa& dfa)
+{
+    writer.classes(dfa.classes);
+    writer.vector(dfa.accepting);
+    writer.bits(dfa.live);
+    writer.value(dfa.start);
+    writer.value(dfa.stride);
+    writer.value(dfa.idWidth);
+    if (dfa.idWidth == 1) writePacked(writer, dfa.packed8);
+    else if (dfa.idWidth == 2) writePacked(writer, dfa.packed16);
+    else if (dfa.idWidth == 4) writePacked(writer, dfa.packed32);
+    else writer.table(dfa.table, CacheAligned<unsigned>::LineSize);
+}
+
+Dfa readDfa(Reader& reader, unsigned definitions)
+{
+    Dfa dfa;
+    dfa.classes = reader.classes();
+    dfa.accepting = reader.vector<int>();
+    dfa.live = reader.bits();
+    dfa.start = reader.value<unsigned>();
+    dfa.stride = reader.value<unsigned>();
+    dfa.idWidth = reader.value<unsigned>();
+    if ((dfa.live.size() != dfa.size()) || (dfa.stride < dfa.classes.count) || (dfa.start >= dfa.size()))
+        throw MalformedSnapshot();
+    for (auto tag : dfa.accepting)
+        if ((tag < NfaState::NoTag) || (tag >= int(definitions))) throw MalformedSnapshot();
+    if (dfa.idWidth != 0)
+        for (unsigned state = 0; state < dfa.size(); ++state) dfa.entries.push_back(dfa.entryOf(state));
+    if (dfa.idWidth == 1) dfa.packed8 = readPacked<uint8_t>(reader, dfa);
+    else if (dfa.idWidth == 2) dfa.packed16 = readPacked<uint16_t>(reader, dfa);
+    else if (dfa.idWidth == 4) dfa.packed32 = readPacked<uint32_t>(reader, dfa);
+    else if (dfa.idWidth != 0) throw MalformedSnapshot();
+    else
+    {
+        dfa.table = reader.table<unsigned, CacheAligned<unsigned>>(CacheAligned<unsigned>::LineSize);
+        if (dfa.table.size() != uint64_t(dfa.size()) * dfa.stride) throw MalformedSnapshot();
+        for (auto entry : dfa.table)
+        {
+            unsigned target = entry & Dfa::TargetMask;
+            if ((target >= dfa.size()) || (entry != dfa.entryOf(target))) throw MalformedSnapshot();
+        }
+    }
+    return dfa;
+}
+
+void writeBitParallel(Writer& writer, const BitParallel& machine)
+{
+    writer.classes(machine.classes);
+    writer.array(machine.byteMatches, 256);
+    writer.vector(machine.classMatches);
+    writer.vector(machine.follow);
+    writer.vector(machine.accepting);
+    writer.value(machine.shiftable);
+    writer.value(machine.live);
+    writer.value(machine.start);
+    writer.value(uint64_t(machine.startLive));
+}
+
+BitParallel readBitParallel(Reader& reader, unsigned definitions)
+{
+    BitParallel machine;
+    machine.classes = reader.classes();
+    reader.array(machine.byteMatches, 256);
+    machine.classMatches = reader.vector<uint64_t>();
+    machine.follow = reader.vector<uint64_t>();
+    machine.accepting = reader.vector<uint64_t>();
+    machine.shiftable = reader.value<uint64_t>();
+    machine.live = reader.value<uint64_t>();
+    machine.start = reader.value<uint64_t>();
+    machine.startLive = reader.value<uint64_t>() != 0;
+    if ((machine.classMatches.size() != machine.classes.count)
+        || (machine.follow.size() > BitParallel::MaxPositions)
+        || (machine.accepting.size() > definitions))
+        throw MalformedSnapshot();
+    // positions without a follow entry must never be matched
+    uint64_t known = (machine.follow.size() == 64) ? ~uint64_t(0) : ((uint64_t(1) << machine.follow.size()) - 1);
+    for (auto positions : machine.classMatches) if (positions & ~known) throw MalformedSnapshot();
+    for (auto positions : machine.byteMatches) if (positions & ~known) throw MalformedSnapshot();
+    return machine;
+}
+
+} //namespace
+
+bool grammarSnapshotsEnabled()
+{
+    const char* directory = std::getenv("CPPGM_GRAMMAR_SNAPSHOTS");
+    return (directory != nullptr) && (*directory != '\0');
+}
+
+std::string grammarSnapshotPath(uint64_t fingerprint)
+{
+    std::ostringstream out;
+    out << std::getenv("CPPGM_GRAMMAR_SNAPSHOTS") << "/" << std::hex << std::setw(16) << std::setfill('0') << fingerprint << ".grammar";
+    return out.str();
+}
+
+bool loadGrammarSnapshot(const std::string& path, uint64_t fingerprint, unsigned definitions, CompiledGrammar& out)
+{
+    uint64_t size = 0;
+    std::shared_ptr<const char> mapping = mapFile(path, size);
+    if (not mapping) return false;
+    try
+    {
+        Reader reader = {mapping, mapping.get(), size, 0};
+        Header header = reader.value<Header>();
+        if ((std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) || (header.version != Version)
+            || (header.build != buildIdentity()) || (header.fingerprint != fingerprint) || (header.size != size)
+            || (checkingPayloads() && (header.checksum != payloadChecksum(mapping.get(), size))))
+            throw MalformedSnapshot();
+        CompiledGrammar grammar;
+        if (header.engine == uint32_t(Engine::Dfa))
+            grammar.dfa = std::make_shared<Dfa>(readDfa(reader, definitions));
+        else if (header.engine == uint32_t(Engine::BitParallel))
+            grammar.bitParallel = std::make_shared<BitParallel>(readBitParallel(reader, definitions));
+        else throw MalformedSnapshot();
+        out = grammar;
+        return true;
+    }
+    catch (MalformedSnapshot&)
+    {
+        return false;
+    }
+}
+
+void saveGrammarSnapshot(const std::string& path, uint64_t fingerprint, const CompiledGrammar& grammar)
+{
+    Writer writer;
+    Header header;
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.engine = uint32_t(grammar.dfa ? Engine::Dfa : Engine::BitParallel);
+    header.fingerprint = fingerprint;
+    header.build = buildIdentity();
+    header.size = 0;
+    header.checksum = 0;
+    writer.value(header);
+    if (grammar.dfa) writeDfa(writer, *grammar.dfa);
+    else writeBitParallel(writer, *grammar.bitParallel);
+    header.size = writer.data.size();
+    header.checksum = payloadChecksum(writer.data.data(), writer.data.size());
+    std::memcpy(&writer.data[0], &header, sizeof(header));
+
+    std::string temporary = path + "." + std::to_string(getpid());
+    FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr) return;
+    bool written = std::fwrite(writer.data.data(), 1, writer.data.size(), file) == writer.data.size();
+    written = (std::fclose(file) == 0) && written;
+    if (not written || (std::rename(temporary.c_str(), path.c_str()) != 0))
+        std::remove(temporary.c_str());
+}
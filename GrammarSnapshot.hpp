@@ -0,0 +1,26 @@
+#pragma once
+
+#include "Dfa.hpp"
+#include "BitParallel.hpp"
+#include <memory>
+#include <string>
+
+// versioned binary form of a compiled grammar, stored as
+// $CPPGM_GRAMMAR_SNAPSHOTS/<fingerprint>.grammar; a snapshot of another
+// fingerprint or written by another build is stale, one whose payload does
+// not match the checksum in its header is corrupt (checked only with
+// CPPGM_GRAMMAR_SNAPSHOT_CHECK set). The transition tables of a loaded
+// snapshot are read in place from the mapped file
+struct CompiledGrammar
+{
+    std::shared_ptr<const Dfa> dfa;
+    std::shared_ptr<const BitParallel> bitParallel;
+    // instead of tables for grammars matched with a lazy dfa, never saved
+    std::shared_ptr<const Nfa> nfa;
+};
+
+bool grammarSnapshotsEnabled();
+std::string grammarSnapshotPath(uint64_t fingerprint);
+// fails on missing, stale or malformed snapshots, which are then rebuilt
+bool loadGrammarSnapshot(const std::string& path, uint64_t fingerprint, unsigned definitions, CompiledGrammar& out);
+void saveGrammarSnapshot(const std::string& path, uint64_t fingerprint, const CompiledGrammar& grammar);
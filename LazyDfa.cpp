@@ -0,0 +1,84 @@
+#include "LazyDfa.hpp"
+#include <algorithm>
+
+LazyDfa::LazyDfa(Nfa nfa, std::size_t budget)
+    : nfa(nfa), classes(partitionAlphabet(nfa)), budget(budget), used(0), generation(0), flushCount(0),
+      reached(nfa.states.size())
+{
+    starting = startStates(nfa);
+}
+
+LazyDfa::NodePtr LazyDfa::start()
+{
+    if (used + nodeCost(starting) > budget) flush();
+    return intern(starting);
+}
+
+LazyDfa::NodePtr LazyDfa::next(const NodePtr& node, uint64_t c)
+{
+    unsigned cls = classes.classOf(c);
+    if ((node->generation == generation) && (node->row[cls] != nullptr))
+        return node->row[cls]->shared_from_this();
+
+    reached.clear();
+    for (auto id : node->states)
+    {
+        const NfaState& state = nfa.states[id];
+        for (unsigned i = state.transitionsBegin; i < state.transitionsEnd; ++i)
+        {
+            const NfaTransition& transition = nfa.transitions[i];
+            if ((transition.chset == Nfa::Epsilon) || not nfa.chsets[transition.chset].contains(c)) continue;
+            addClosure(nfa, transition.target, reached);
+        }
+    }
+    NfaStateIds targets = sortedIds(reached);
+
+    if (used + nodeCost(targets) + nodeCost(node->states) > budget) flush();
+    NodePtr source = (node->generation == generation) ? node : intern(node->states);
+    NodePtr target = intern(targets);
+    source->row[cls] = target.get();
+    return target;
+}
+
+std::size_t LazyDfa::memoryUsed() const
+{
+    return used;
+}
+
+unsigned LazyDfa::flushes() const
+{
+    return flushCount;
+}
+
+std::size_t LazyDfa::nodeCost(const NfaStateIds& states) const
+{
+    return sizeof(Node) + states.size() * sizeof(unsigned) + classes.count * sizeof(Node*) + 4 * sizeof(void*);
+}
+
+LazyDfa::NodePtr LazyDfa::intern(const NfaStateIds& states)
+{
+    auto it = cache.find(states);
+    if (it != cache.end()) return it->second;
+    NodePtr node = std::make_shared<Node>();
+    node->states = states;
+    node->accepting = acceptedTag(nfa, states);
+    node->live = isLive(nfa, states);
+    node->generation = generation;
+    node->row.assign(classes.count, nullptr);
+    cache[states] = node;
+    used += nodeCost(states);
+    return node;
+}
+
+void LazyDfa::flush()
+{
+    for (auto& entry : cache)
+    {
+        entry.second->row.clear();
+        entry.second->row.shrink_to_fit();
+    }
+    cache.clear();
+    used = 0;
+    ++generation;
+    ++flushCount;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Nfa.hpp"
+#include "CharClasses.hpp"
+#include <memory>
+#include <map>
+
+// dfa built on demand while simulating the nfa, every state set reached
+// is memoized together with a row of known targets per character class;
+// when the memoized states outgrow the budget the cache is flushed
+class LazyDfa
+{
+public:
+    struct Node;
+    typedef std::shared_ptr<Node> NodePtr;
+
+    struct Node : std::enable_shared_from_this<Node>
+    {
+        NfaStateIds states;
+        int accepting;
+        bool live;
+        unsigned generation;
+        std::vector<Node*> row;
+    };
+
+    LazyDfa(Nfa nfa, std::size_t budget);
+
+    NodePtr start();
+    NodePtr next(const NodePtr& node, uint64_t c);
+
+    std::size_t memoryUsed() const;
+    unsigned flushes() const;
+
+private:
+    Nfa nfa;
+    CharClasses classes;
+    std::size_t budget;
+    std::size_t used;
+    unsigned generation;
+    unsigned flushCount;
+    std::map<NfaStateIds, NodePtr> cache;
+    NfaStateIds starting;
+    SparseSet reached;
+
+    std::size_t nodeCost(const NfaStateIds& states) const;
+    NodePtr intern(const NfaStateIds& states);
+    void flush();
+};
@@ -3,7 +3,31 @@
 
 #include "StateMachine.hpp"
 #include "RegexRule.hpp"
-#include <map>
+#include "FirstChars.hpp"
+#include "Ring.hpp"
+#include <cwchar>
+#include <functional>
+
+// characters of a token, viewed where they are stored: in the window of the
+// stage which produced it or in a string of the caller; valid only until
+// the handler it was passed to returns
+class TokenText
+{
+    const wchar_t* first;
+    std::size_t length;
+public:
+    TokenText(const wchar_t* first, std::size_t length) : first(first), length(length) {}
+    TokenText(const std::wstring& text) : first(text.data()), length(text.size()) {}
+    TokenText(const wchar_t* text) : first(text), length(std::wcslen(text)) {}
+
+    std::size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    wchar_t operator[](std::size_t i) const { return first[i]; }
+    wchar_t back() const { return first[length - 1]; }
+    const wchar_t* begin() const { return first; }
+    const wchar_t* end() const { return first + length; }
+    std::wstring str() const { return std::wstring(first, length); }
+};
 
 struct InvalidChar : std::runtime_error
 {
@@ -21,83 +45,164 @@ struct IncompleteToken : std::runtime_error
 };
 
 
+// token kept as the offset of its text in a buffer
 template <typename TokenType>
+struct RecognizedToken
+{
+    TokenType token;
+    std::size_t offset;
+    std::size_t length;
+};
+
+// maximal munch over a single automaton of all token definitions; on a tie
+// the definition given later wins; characters read past the longest match
+// are kept pending in a ring and scanned again for the next token, so a
+// steady flow of characters does not allocate; their text is appended once
+// to a window, tokens are passed on as views into it and the window drops
+// their text when the handler returns; a token start no
+// definition can begin with fails without running the automaton, the
+// definitions ruled out by their first character are counted as skipped.
+// A machine built without a handler collects the tokens instead, as offsets
+// into the window which keeps their text until flush()
+template <typename TokenType, typename Handler = std::function<void(TokenType, TokenText)>>
 struct TokenizerMachine
 {
-    typedef std::pair<unsigned, TokenType> TokenCandidate;
-    typedef std::vector<StateMachine> StateMachines;
-    typedef std::pair<StateMachines, TokenCandidate> OngoingToken;
-    typedef std::map<unsigned, OngoingToken> OngoingTokens;
-    typedef std::function<void(TokenType, std::wstring)> TokenHandler;
-    typedef std::pair<StateMachine, TokenType> TokenMatcher;
-    typedef std::vector<TokenMatcher> TokenMatchers;
+    typedef Handler TokenHandler;
+    typedef std::pair<TokenType, Rule> TokenDefinition;
+    typedef std::vector<TokenDefinition> TokenDefinitions;
+    typedef std::pair<uint64_t, unsigned> PendingChar;
+    typedef Ring<PendingChar> PendingChars;
 
-    OngoingTokens ongoing;
-    StateMachines startingMachines;
+    typedef RecognizedToken<TokenType> Recognized;
+
+    StateMachine machine;
+    std::shared_ptr<const FirstCharDispatch> dispatch;
     std::vector<TokenType> tokens;
     TokenHandler handler;
-    std::wstring buffer;
-    unsigned lastEmittedEnd;
-    unsigned processed;
+    bool collecting;
+    std::vector<Recognized> recognized;
+    std::wstring window;
+    std::size_t windowStart;
+    PendingChars pending;
+    unsigned scanned;
+    unsigned scannedLength;
+    unsigned candidateChars;
+    unsigned candidateLength;
+    TokenType candidateToken;
+    unsigned long spawnedDefinitions;
+    unsigned long skippedDefinitions;
+
+    TokenizerMachine(const TokenDefinitions& definitions, TokenHandler handler)
+        : TokenizerMachine(definitions, handler, false)
+    {}
 
-    TokenizerMachine(TokenMatchers matchers, TokenHandler handler)
-        : startingMachines(matchers.size()),
-          tokens(matchers.size()),
+    TokenizerMachine(const TokenDefinitions& definitions)
+        : TokenizerMachine(definitions, TokenHandler(), true)
+    {}
+
+    TokenizerMachine(const TokenDefinitions& definitions, TokenHandler handler, bool collecting)
+        : machine(rulesOf(definitions)),
+          dispatch(firstCharDispatch(rulesOf(definitions))),
           handler(handler),
-          lastEmittedEnd(0),
-          processed(0)
+          collecting(collecting),
+          windowStart(0),
+          scanned(0),
+          scannedLength(0),
+          candidateChars(0),
+          candidateLength(0),
+          spawnedDefinitions(0),
+          skippedDefinitions(0)
     {
-        for (unsigned i = 0; i < matchers.size(); ++i)
-        {
-            startingMachines[i] = matchers[i].first;
-            tokens[i] = matchers[i].second;
-        }
+        for (auto& definition : definitions)
+            tokens.push_back(definition.first);
+    }
+
+    static Rules rulesOf(const TokenDefinitions& definitions)
+    {
+        Rules out;
+        for (auto& definition : definitions)
+            out.push_back(definition.second);
+        return out;
     }
 
-    void process(uint64_t c, std::wstring actualText)
+    void process(uint64_t c, TokenText actualText)
     {
-        buffer += actualText;
-        processed += actualText.size();
-        ongoing[processed - 1] = {startingMachines, {0, TokenType()}};
-        
-        auto it = ongoing.begin();
-        while (it != ongoing.end())
+        window.append(actualText.begin(), actualText.size());
+        pending.push_back(PendingChar(c, actualText.size()));
+
+        while (scanned < pending.size())
         {
-            bool neverWillMatchAgain = true;
-            StateMachines& curr = it->second.first;
-            TokenType tokenSoFar = TokenType();
-            for (unsigned j = 0; j < curr.size(); ++j)
+            const PendingChar& curr = pending[scanned++];
+            scannedLength += curr.second;
+            if (scanned == 1)
             {
-                if (curr[j].foreverUnmatched()) continue;
-                if (curr[j].process(c))
-                {
-                    it->second.second = TokenCandidate(processed, tokens[j]);
-                    ongoing.erase(ongoing.lower_bound(it->first + 1), ongoing.upper_bound(processed));
-                }
-                if (not curr[j].foreverUnmatched())
-                {
-                    neverWillMatchAgain = false;
-                    tokenSoFar = tokens[j];
-                }
+                unsigned candidates = dispatch->candidates(curr.first);
+                spawnedDefinitions += candidates;
+                skippedDefinitions += tokens.size() - candidates;
+                if (candidates == 0) fail();
             }
-            if (neverWillMatchAgain && (it == ongoing.begin()))
+            if (machine.process(curr.first))
             {
-                auto tokenCand = it->second.second;
-                if (tokenCand.first == 0)
-                {
-                    if (processed - lastEmittedEnd <= 1) throw InvalidChar(buffer);
-                    else throw IncompleteToken<TokenType>(buffer, tokenSoFar);
-                }
-                handler(tokenCand.second, buffer.substr(0, tokenCand.first - lastEmittedEnd));
-                buffer = buffer.substr(tokenCand.first - lastEmittedEnd);
-                lastEmittedEnd = tokenCand.first;
-                auto toErase = it;
-                ++it;
-                ongoing.erase(toErase);
+                candidateChars = scanned;
+                candidateLength = scannedLength;
+                candidateToken = tokens[machine.matchedDefinition()];
             }
-            else ++it;
+            if (not machine.foreverUnmatched()) continue;
+
+            if (candidateChars == 0) fail();
+            if (collecting) recognized.push_back({candidateToken, windowStart, candidateLength});
+            else handler(candidateToken, TokenText(window.data() + windowStart, candidateLength));
+            release(candidateLength);
+            pending.pop_front(candidateChars);
+            machine.reset();
+            scanned = 0;
+            scannedLength = 0;
+            candidateChars = 0;
+            candidateLength = 0;
         }
     }
+
+    TokenText textOf(const Recognized& token) const
+    {
+        return TokenText(window.data() + token.offset, token.length);
+    }
+
+    // drops the collected tokens together with their text
+    void flush()
+    {
+        recognized.clear();
+        compact();
+    }
+
+    // the collected tokens and the window were swapped out for buffers to
+    // reuse, the window was left with the pending characters only
+    void handedOff()
+    {
+        recognized.clear();
+        windowStart = 0;
+    }
+
+    // the window is compacted once most of it was released
+    void release(std::size_t length)
+    {
+        windowStart += length;
+        if (not collecting) compact();
+    }
+
+    void compact()
+    {
+        if (windowStart == window.size()) window.clear();
+        else if (windowStart < window.size() / 2) return;
+        else window.erase(0, windowStart);
+        windowStart = 0;
+    }
+
+    void fail() const
+    {
+        std::wstring text = window.substr(windowStart);
+        if (text.size() <= 1) throw InvalidChar(text);
+        else throw IncompleteToken<TokenType>(text, TokenType());
+    }
 };
 
 template <typename InType, typename OutType>
@@ -106,34 +211,20 @@ struct TokenizerChainLink
     typedef InType FirstType;
     typedef OutType SecondType;
 
-    typedef std::function<void(OutType, std::wstring)> NextHandler;
+    typedef std::function<void(OutType, TokenText)> NextHandler;
     typedef std::pair<OutType, Rule> TokenDefinition;
     typedef std::vector<TokenDefinition> TokenDefinitions;
-    typedef std::pair<StateMachine, OutType> TokenMatcher;
-    typedef std::vector<TokenMatcher> TokenMatchers;
 
     TokenizerMachine<OutType> machine;
 
     TokenizerChainLink(NextHandler handler, TokenDefinitions defs)
-        : machine(createMatchers(defs), handler)
+        : machine(defs, handler)
     {}
 
-    void process(const InType& token, std::wstring actualText)
+    void process(const InType& token, TokenText actualText)
     {
         machine.process(uint64_t(token), actualText);
     }
-
-    TokenMatcher createMatcher(const TokenDefinition& definition)
-    {
-        return TokenMatcher(StateMachine(definition.second), definition.first);
-    }
-    TokenMatchers createMatchers(const TokenDefinitions& definitions)
-    {
-        TokenMatchers out;
-        for (auto definition : definitions)
-            out.push_back(createMatcher(definition));
-        return out;
-    }
 };
 
 template <typename PrevOut, typename In, typename Out>
@@ -153,9 +244,9 @@ struct TokenizerChainLinkHandler
     {
     }
 
-    void operator()(PrevOutType token, std::wstring text)
+    void operator()(PrevOutType token, TokenText text)
     {
-        handler(token, text, [&](InType token, std::wstring text){ link.process(token, text); });
+        handler(token, text, [&](InType token, TokenText text){ link.process(token, text); });
     }
 };
 
@@ -168,9 +259,9 @@ struct TokenizerChain : TokenizerChain<OtherLinks...>
 
     typedef std::pair<OutType, Rule> Definition;
     typedef std::vector<Definition> Definitions;
-    typedef std::function<void(PrevOutType, std::wstring)> LinkHandler;
-    typedef std::function<void(InType, std::wstring)> NextLinkHandler;
-    typedef std::function<void(PrevOutType, std::wstring, NextLinkHandler)> PhaseLinker;
+    typedef std::function<void(PrevOutType, TokenText)> LinkHandler;
+    typedef std::function<void(InType, TokenText)> NextLinkHandler;
+    typedef std::function<void(PrevOutType, TokenText, NextLinkHandler)> PhaseLinker;
 
     typedef typename TokenizerChainLink::type Link;
     LinkHandler handler;
@@ -194,9 +285,9 @@ struct TokenizerChain<TokenizerChainLink>
 
     typedef std::pair<OutType, Rule> Definition;
     typedef std::vector<Definition> Definitions;
-    typedef std::function<void(PrevOutType, std::wstring)> LinkHandler;
-    typedef std::function<void(InType, std::wstring)> NextLinkHandler;
-    typedef std::function<void(PrevOutType, std::wstring, NextLinkHandler)> PhaseLinker;
+    typedef std::function<void(PrevOutType, TokenText)> LinkHandler;
+    typedef std::function<void(InType, TokenText)> NextLinkHandler;
+    typedef std::function<void(PrevOutType, TokenText, NextLinkHandler)> PhaseLinker;
 
     typedef typename TokenizerChainLink::type Link;
     LinkHandler handler;
@@ -210,5 +301,145 @@ struct TokenizerChain<TokenizerChainLink>
     {}
 };
 
+// chain composed at compile time: each link is a linker, a plain callable
+// invoked with the previous token, its text and the next stage, followed by
+// the machine of its definitions feeding the rest of the chain; no call
+// between stages is type-erased, so the stages can be inlined into one loop.
+// Input is taken in blocks: a link runs its linker and machine over the
+// whole block and passes the tokens recognized as one block to the next
+// link, their text stays in the window of the machine until it returns,
+// or a pipeline stage in between takes the window over with them.
+// When a stage fails, the tokens it recognized before are still passed on,
+// so the output up to an error does not depend on the block size.
+// TokenizerChain above takes std::function linkers for chains assembled at
+// runtime
+template <typename Linker, typename OutType, typename Next>
+struct StaticTokenizerChainLink;
+
+template <typename Handler, typename InType>
+void passBlock(Handler& handler, const std::pair<InType, TokenText>* tokens, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+        handler(tokens[i].first, tokens[i].second);
+}
+
+template <typename Linker, typename OutType, typename Next, typename InType>
+void passBlock(StaticTokenizerChainLink<Linker, OutType, Next>& link,
+               const std::pair<InType, TokenText>* tokens, std::size_t count)
+{
+    link.processBlock(tokens, count);
+}
+
+// views of the tokens collected by a machine into its window
+template <typename OutType>
+void tokenViews(TokenizerMachine<OutType>& machine, std::vector<std::pair<OutType, TokenText>>& block)
+{
+    block.clear();
+    for (auto& token : machine.recognized)
+        block.push_back(std::make_pair(token.token, machine.textOf(token)));
+}
+
+// the next stage gets the collected tokens as one block
+template <typename Next, typename OutType>
+void passTokens(Next& next, TokenizerMachine<OutType>& machine, std::vector<std::pair<OutType, TokenText>>& block)
+{
+    tokenViews(machine, block);
+    passBlock(next, block.data(), block.size());
+    machine.flush();
+}
+
+template <typename Linker, typename OutType, typename Next>
+struct StaticTokenizerChainLink
+{
+    typedef std::vector<std::pair<OutType, Rule>> Definitions;
+    typedef std::pair<OutType, TokenText> Output;
+
+    Linker linker;
+    TokenizerMachine<OutType> machine;
+    std::vector<Output> block;
+    Next next;
+
+    StaticTokenizerChainLink(Linker linker, const Definitions& definitions, Next next)
+        : linker(linker), machine(definitions), next(next)
+    {}
+
+    template <typename InType>
+    void operator()(InType token, TokenText text)
+    {
+        std::pair<InType, TokenText> single(token, text);
+        processBlock(&single, 1);
+    }
+
+    template <typename InType>
+    void processBlock(const std::pair<InType, TokenText>* tokens, std::size_t count)
+    {
+        try
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                linker(tokens[i].first, tokens[i].second,
+                       [this](uint64_t c, TokenText text) { machine.process(c, text); });
+        }
+        catch (...)
+        {
+            passRecognized();
+            throw;
+        }
+        passRecognized();
+    }
+
+    void passRecognized()
+    {
+        if (not machine.recognized.empty()) passTokens(next, machine, block);
+    }
+};
+
+// type and construction of a chain from the final handler and a
+// (linker, definitions) pair per link, in the order the input flows
+template <typename FinalHandler, typename... Links>
+struct StaticTokenizerChain
+{
+    typedef FinalHandler type;
+
+    static type make(FinalHandler finalHandler)
+    {
+        return finalHandler;
+    }
+};
+
+template <typename FinalHandler, typename Linker, typename OutType, typename... Links>
+struct StaticTokenizerChain<FinalHandler, std::pair<Linker, std::vector<std::pair<OutType, Rule>>>, Links...>
+{
+    typedef StaticTokenizerChain<FinalHandler, Links...> Tail;
+    typedef StaticTokenizerChainLink<Linker, OutType, typename Tail::type> type;
+
+    static type make(FinalHandler finalHandler,
+                     const std::pair<Linker, std::vector<std::pair<OutType, Rule>>>& linkData,
+                     const Links& ...tailLinksData)
+    {
+        return type(linkData.first, linkData.second, Tail::make(finalHandler, tailLinksData...));
+    }
+};
+
+// definitions spawned and skipped by the first-character dispatch of a
+// machine at the token starts it saw
+typedef std::pair<unsigned long, unsigned long> DispatchCounts;
+
+template <typename Handler>
+void collectDispatchCounts(Handler&, std::vector<DispatchCounts>&);
+template <typename Linker, typename OutType, typename Next>
+void collectDispatchCounts(StaticTokenizerChainLink<Linker, OutType, Next>& link, std::vector<DispatchCounts>& out);
+
+template <typename Handler>
+void collectDispatchCounts(Handler&, std::vector<DispatchCounts>&)
+{
+}
+
+template <typename Linker, typename OutType, typename Next>
+void collectDispatchCounts(StaticTokenizerChainLink<Linker, OutType, Next>& link, std::vector<DispatchCounts>& out)
+{
+    out.push_back(DispatchCounts(link.machine.spawnedDefinitions, link.machine.skippedDefinitions));
+    collectDispatchCounts(link.next, out);
+}
+
 #endif //LEXER_HPP
 
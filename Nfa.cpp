@@ -0,0 +1,260 @@
+#include "Nfa.hpp"
+#include <cassert>
+#include <algorithm>
+#include <map>
+
+namespace
+{
+const unsigned Dangling = Nfa::NoState;
+
+typedef std::vector<NfaTransition> Transitions;
+typedef std::vector<unsigned> AutomataEndings;
+typedef std::pair<unsigned, AutomataEndings> AutomataUnderConstruction;
+typedef std::vector<AutomataUnderConstruction> AutomatasUnderConstruction;
+
+// states keep their own transition lists until the nfa is packed,
+// dangling transitions lead to the accepting state of the definition
+struct NfaUnderConstruction
+{
+    std::vector<Transitions> transitions;
+    std::vector<int> tags;
+    std::map<CharRanges, unsigned> chsetIds;
+    std::vector<Chset> chsets;
+
+    unsigned createState(int tag = NfaState::NoTag)
+    {
+        transitions.push_back({});
+        tags.push_back(tag);
+        return tags.size() - 1;
+    }
+
+    unsigned chsetId(const Chset& chset)
+    {
+        if (chset.ranges.empty()) return Nfa::Epsilon;
+        auto it = chsetIds.find(chset.ranges);
+        if (it != chsetIds.end()) return it->second;
+        chsets.push_back(chset);
+        return chsetIds[chset.ranges] = chsets.size() - 1;
+    }
+};
+
+AutomataUnderConstruction createAutomata(NfaUnderConstruction& nfa, const Rule& rule);
+AutomataUnderConstruction createOrAutomata(NfaUnderConstruction& nfa, const Rule& rule)
+{
+    assert(rule.discriminator() == Rule::Type::DOrSeq);
+    AutomatasUnderConstruction automatas;
+    for (auto& subrule : rule.subrules())
+    {
+        automatas.push_back(createAutomata(nfa, subrule));
+    }
+    unsigned start = nfa.createState();
+    AutomataEndings endings;
+    for (auto automata : automatas)
+    {
+        // an empty branch gets a state of its own, as only the first
+        // transition of an ending is linked to what follows
+        if (automata.first == Dangling)
+        {
+            unsigned skip = nfa.createState();
+            nfa.transitions[skip].push_back({Nfa::Epsilon, Dangling});
+            automata = AutomataUnderConstruction(skip, {skip});
+        }
+        endings.insert(endings.end(), automata.second.begin(), automata.second.end());
+        nfa.transitions[start].push_back({Nfa::Epsilon, automata.first});
+    }
+    return AutomataUnderConstruction(start, endings);
+}
+AutomataUnderConstruction createRepeatAutomata(NfaUnderConstruction& nfa, const Rule& rule)
+{
+    assert(rule.discriminator() == Rule::Type::DRepeat);
+    assert(rule.subrules().size() == 1);
+    AutomataUnderConstruction subautomata = createAutomata(nfa, rule.subrules().front());
+    if (subautomata.first == Dangling) return subautomata;
+    for (auto ending : subautomata.second)
+    {
+        NfaTransition endingTransition = nfa.transitions[ending].front();
+        endingTransition.target = subautomata.first;
+        nfa.transitions[ending].push_back(endingTransition);
+    }
+    unsigned startState = nfa.createState();
+    nfa.transitions[startState].push_back({Nfa::Epsilon, Dangling});
+    nfa.transitions[startState].push_back({Nfa::Epsilon, subautomata.first});
+    subautomata.second.push_back(startState);
+    return AutomataUnderConstruction(startState, subautomata.second);
+}
+AutomataUnderConstruction createSeqAutomata(NfaUnderConstruction& nfa, const Rule& rule)
+{
+    assert(rule.discriminator() == Rule::Type::DSeq);
+    AutomatasUnderConstruction automatas;
+    for (auto& subrule : rule.subrules())
+    {
+        automatas.push_back(createAutomata(nfa, subrule));
+    }
+    AutomataUnderConstruction prev = automatas.front();
+    for (auto automataIt = automatas.begin() + 1; automataIt != automatas.end(); ++automataIt)
+    {
+        if (automataIt->first == Dangling) continue;
+        for (auto ending : prev.second)
+            nfa.transitions[ending].front().target = automataIt->first;
+        prev = *automataIt;
+    }
+    return AutomataUnderConstruction(automatas.front().first, prev.second);
+}
+AutomataUnderConstruction createChsetAutomata(NfaUnderConstruction& nfa, const Rule& rule)
+{
+    assert(rule.discriminator() == Rule::Type::DChset);
+    assert(rule.subrules().empty());
+    unsigned start = nfa.createState();
+    nfa.transitions[start].push_back({nfa.chsetId(rule.chset()), Dangling});
+    return AutomataUnderConstruction(start, {start});
+}
+AutomataUnderConstruction createEmptyAutomata()
+{
+    return AutomataUnderConstruction(Dangling, {});
+}
+AutomataUnderConstruction createAutomata(NfaUnderConstruction& nfa, const Rule& rule)
+{
+    switch (rule.discriminator())
+    {
+        case Rule::Type::DChset:
+            return createChsetAutomata(nfa, rule);
+        case Rule::Type::DSeq:
+            return createSeqAutomata(nfa, rule);
+        case Rule::Type::DRepeat:
+            return createRepeatAutomata(nfa, rule);
+        case Rule::Type::DOrSeq:
+            return createOrAutomata(nfa, rule);
+        case Rule::Type::DEmpty:
+            return createEmptyAutomata();
+        default:
+            return AutomataUnderConstruction(Dangling, {});
+    }
+}
+
+void computeClosures(Nfa& nfa)
+{
+    SparseSet visited(nfa.states.size());
+    NfaStateIds stack;
+    for (unsigned id = 0; id < nfa.states.size(); ++id)
+    {
+        nfa.closuresBegin.push_back(nfa.closures.size());
+        visited.clear();
+        stack.assign(1, id);
+        while (not stack.empty())
+        {
+            unsigned curr = stack.back();
+            stack.pop_back();
+            if (visited.contains(curr)) continue;
+            visited.insert(curr);
+            const NfaState& state = nfa.states[curr];
+            for (unsigned i = state.transitionsBegin; i < state.transitionsEnd; ++i)
+            {
+                const NfaTransition& transition = nfa.transitions[i];
+                // states of skipped definitions may still point nowhere
+                if ((transition.chset == Nfa::Epsilon) && (transition.target != Nfa::NoState)
+                    && not visited.contains(transition.target))
+                    stack.push_back(transition.target);
+            }
+        }
+        NfaStateIds closure = sortedIds(visited);
+        nfa.closures.insert(nfa.closures.end(), closure.begin(), closure.end());
+    }
+    nfa.closuresBegin.push_back(nfa.closures.size());
+}
+
+Nfa pack(NfaUnderConstruction& constructed, unsigned start)
+{
+    Nfa nfa;
+    nfa.start = start;
+    nfa.chsets.swap(constructed.chsets);
+    for (unsigned id = 0; id < constructed.tags.size(); ++id)
+    {
+        unsigned begin = nfa.transitions.size();
+        nfa.transitions.insert(nfa.transitions.end(),
+                               constructed.transitions[id].begin(), constructed.transitions[id].end());
+        nfa.states.push_back({constructed.tags[id], begin, unsigned(nfa.transitions.size())});
+    }
+    computeClosures(nfa);
+    return nfa;
+}
+
+} //namespace
+
+const int NfaState::NoTag;
+const unsigned Nfa::NoState;
+const unsigned Nfa::Epsilon;
+
+Nfa createNfa(const Rule& rule)
+{
+    return createNfa(Rules({rule}));
+}
+
+Nfa createNfa(const Rules& rules)
+{
+    NfaUnderConstruction nfa;
+    std::vector<unsigned> starts;
+    for (unsigned tag = 0; tag < rules.size(); ++tag)
+    {
+        unsigned firstState = nfa.tags.size();
+        unsigned start = createAutomata(nfa, rules[tag]).first;
+        if (start == Dangling) continue;
+        unsigned lastState = nfa.tags.size();
+        unsigned accepting = nfa.createState(tag);
+        for (unsigned id = firstState; id < lastState; ++id)
+            for (auto& transition : nfa.transitions[id])
+                if (transition.target == Dangling) transition.target = accepting;
+        starts.push_back(start);
+    }
+    if (starts.size() == 1) return pack(nfa, starts.front());
+    if (starts.empty()) return pack(nfa, Nfa::NoState);
+    unsigned start = nfa.createState();
+    for (auto subStart : starts)
+        nfa.transitions[start].push_back({Nfa::Epsilon, subStart});
+    return pack(nfa, start);
+}
+
+void addClosure(const Nfa& nfa, unsigned state, SparseSet& out)
+{
+    for (unsigned i = nfa.closuresBegin[state]; i < nfa.closuresBegin[state + 1]; ++i)
+        out.insert(nfa.closures[i]);
+}
+
+NfaStateIds sortedIds(const SparseSet& set)
+{
+    NfaStateIds out(set.begin(), set.end());
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+NfaStateIds epsilonClosure(const Nfa& nfa, const NfaStateIds& ids)
+{
+    if (ids.size() == 1)
+        return NfaStateIds(nfa.closures.begin() + nfa.closuresBegin[ids.front()],
+                           nfa.closures.begin() + nfa.closuresBegin[ids.front() + 1]);
+    SparseSet out(nfa.states.size());
+    for (auto id : ids) addClosure(nfa, id, out);
+    return sortedIds(out);
+}
+
+NfaStateIds startStates(const Nfa& nfa)
+{
+    if (nfa.start == Nfa::NoState) return {};
+    NfaStateIds out;
+    for (auto id : epsilonClosure(nfa, {nfa.start}))
+        if (nfa.states[id].tag == NfaState::NoTag) out.push_back(id);
+    return out;
+}
+
+int acceptedTag(const Nfa& nfa, const NfaStateIds& ids)
+{
+    int out = NfaState::NoTag;
+    for (auto id : ids) out = std::max(out, nfa.states[id].tag);
+    return out;
+}
+
+bool isLive(const Nfa& nfa, const NfaStateIds& ids)
+{
+    for (auto id : ids)
+        if (nfa.states[id].tag == NfaState::NoTag) return true;
+    return false;
+}
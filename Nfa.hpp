@@ -0,0 +1,84 @@
+#pragma once
+
+#include "RegexRule.hpp"
+#include <vector>
+
+// transitions of a state are a contiguous slice of Nfa::transitions,
+// chset indexes Nfa::chsets or is Epsilon; states with a tag are
+// accepting states of the definition with that index
+struct NfaTransition
+{
+    unsigned chset;
+    unsigned target;
+};
+
+struct NfaState
+{
+    static const int NoTag = -1;
+
+    int tag;
+    unsigned transitionsBegin;
+    unsigned transitionsEnd;
+};
+
+// epsilon closure of state i is the sorted slice
+// closures[closuresBegin[i], closuresBegin[i + 1]), computed once when built
+struct Nfa
+{
+    static const unsigned NoState = -1;
+    static const unsigned Epsilon = -1;
+
+    unsigned start;
+    std::vector<NfaState> states;
+    std::vector<NfaTransition> transitions;
+    std::vector<Chset> chsets;
+    std::vector<unsigned> closuresBegin;
+    std::vector<unsigned> closures;
+};
+
+// set of ids below a fixed capacity with constant time insert, lookup and
+// clear; elements are kept in insertion order and never reallocated
+class SparseSet
+{
+    std::vector<unsigned> sparse;
+    std::vector<unsigned> dense;
+public:
+    SparseSet(unsigned capacity = 0) : sparse(capacity)
+    {
+        dense.reserve(capacity);
+    }
+    bool contains(unsigned id) const
+    {
+        unsigned index = sparse[id];
+        return (index < dense.size()) && (dense[index] == id);
+    }
+    void insert(unsigned id)
+    {
+        if (contains(id)) return;
+        sparse[id] = dense.size();
+        dense.push_back(id);
+    }
+    void clear() { dense.clear(); }
+    bool empty() const { return dense.empty(); }
+    std::vector<unsigned>::const_iterator begin() const { return dense.begin(); }
+    std::vector<unsigned>::const_iterator end() const { return dense.end(); }
+};
+
+// bumped whenever createNfa builds other automata from the same rules,
+// like the revisions of the dfa steps
+const unsigned NfaConstructionRevision = 2;
+
+Nfa createNfa(const Rule& rule);
+// union of definitions, reaching an accepting state of rules[i] is tagged with i
+Nfa createNfa(const Rules& rules);
+
+typedef std::vector<unsigned> NfaStateIds;
+
+NfaStateIds epsilonClosure(const Nfa& nfa, const NfaStateIds& ids);
+// adds the closure of state to out
+void addClosure(const Nfa& nfa, unsigned state, SparseSet& out);
+NfaStateIds sortedIds(const SparseSet& set);
+NfaStateIds startStates(const Nfa& nfa);
+// highest tag of accepting states in the set, or NfaState::NoTag
+int acceptedTag(const Nfa& nfa, const NfaStateIds& ids);
+bool isLive(const Nfa& nfa, const NfaStateIds& ids);
@@ -12,9 +12,12 @@
 #include <map>
 #include <functional>
 #include <limits>
+#include <algorithm>
+#include <cstdlib>
 #include "RegexRule.hpp"
 #include "StateMachine.hpp"
 #include "Lexer.hpp"
+#include "Pipeline.hpp"
 
 namespace {
 
@@ -69,24 +72,14 @@ enum class CommentPhaseToken
     CharacterLiteral
 };
 
-typedef TokenizerChain<
-    TokenizerChainLinkType<uint64_t, uint64_t, PrephaseToken>,
-    TokenizerChainLinkType<PrephaseToken, uint64_t, FirstPhaseToken>,
-    TokenizerChainLinkType<FirstPhaseToken, uint64_t, CommentPhaseToken>,
-    TokenizerChainLinkType<CommentPhaseToken, uint64_t, Token>> ChainedTokenizer;
-
-typedef std::function<void (uint64_t, std::wstring)> Handler;
-typedef std::function<void(uint64_t, std::wstring, Handler)> InitialLinker;
-typedef std::function<void(PrephaseToken, std::wstring, Handler)> PreToFirstPhaseLinker;
-typedef std::function<void(FirstPhaseToken, std::wstring, Handler)> FirstToCommentPhaseLinker;
-typedef std::function<void(CommentPhaseToken, std::wstring, Handler)> CommentToSecondPhaseLinker;
 typedef std::vector<std::pair<PrephaseToken, Rule>> PrephaseDefinitions;
 typedef std::vector<std::pair<FirstPhaseToken, Rule>> FirstPhaseDefinitions;
 typedef std::vector<std::pair<CommentPhaseToken, Rule>> CommentPhaseDefinitions;
 typedef std::vector<std::pair<Token, Rule>> SecondPhaseDefinitions;
 
-void tokenHandler(Token token, std::wstring val, std::shared_ptr<IPPTokenStream>& output)
+void tokenHandler(Token token, TokenText text, const std::shared_ptr<IPPTokenStream>& output)
 {
+    std::wstring val = text.str();
     //std::wcerr << L"tokenHandler: " << std::hex << uint64_t(token) << L" " << val << std::endl;
     if (token == Token::CharacterLiteral)
     {
@@ -134,45 +127,73 @@ void tokenHandler(Token token, std::wstring val, std::shared_ptr<IPPTokenStream>
     }
 }
 
-void commentAndSecondPhaseLinker(CommentPhaseToken t, std::wstring text, Handler h)
+struct TokenHandler
 {
-    //std::wcerr << L"commentAndSecondPhaseLinker: " << std::hex << uint64_t(t) << L" " << uint64_t(text[0]) << std::endl;
-    if (t == CommentPhaseToken::PlainCharacter) h(wcharToUint64(text[0]), text);
-    if (t == CommentPhaseToken::MultiLineComment) h(' ', text);
-    if (t == CommentPhaseToken::SingleLineComment) h(' ', text);
-    if (t == CommentPhaseToken::CharacterLiteral)
-        for (auto c : text) h(wcharToUint64(c), {c});
-    if ((t == CommentPhaseToken::StringLiteral) || (t == CommentPhaseToken::String))
-        h(String, text);
-    if (t == CommentPhaseToken::StartOfFile) h(StartOfFile, text);
-    if (t == CommentPhaseToken::EndOfFile) h(EndOfFile, text);
-    if (t == CommentPhaseToken::CommentBegin) h(CommentBegin, text);
-}
-void firstAndCommentPhaseLinker(FirstPhaseToken t, std::wstring text, Handler h)
+    std::shared_ptr<IPPTokenStream> output;
+
+    void operator()(Token token, TokenText text) const
+    {
+        tokenHandler(token, text, output);
+    }
+};
+
+struct InitialLinker
 {
-    //std::wcerr << L"firstAndCommentPhaseLinker: " << std::hex << uint64_t(t) << L" " << text << std::endl;
-    if (t == FirstPhaseToken::PlainCharacter) h(wcharToUint64(text[0]), text);
-    if (t == FirstPhaseToken::MultiLineCommentStart) h(CommentBegin, text);
-    if (t == FirstPhaseToken::UniversalCharacterTuple)
+    template <typename Handler>
+    void operator()(uint64_t c, TokenText text, const Handler& h) const
     {
-        uint64_t aux = 0;
-        for (unsigned i = 2; i < text.size(); ++i)
-            aux = (aux << 4) + HexCharToValue(text[i]);
-        wchar_t c = toWideCharInUtf8(aux);
-        //std::wcerr << text << L": " << std::hex << wcharToUint64(c) << L" " << std::wstring({c}) << std::endl;
-        h(wcharToUint64(c), {c});
+        h(c, text);
     }
-    if (t == FirstPhaseToken::UniversalCharacter)
+};
+
+struct CommentToSecondPhaseLinker
+{
+    template <typename Handler>
+    void operator()(CommentPhaseToken t, TokenText text, const Handler& h) const
     {
-        uint64_t aux = 0;
-        for (unsigned i = 0; i < text.size(); ++i)
-            aux = (aux << 8) + wcharToUint64(text[i]);
-        h(aux, {wchar_t(aux)});
+        //std::wcerr << L"commentAndSecondPhaseLinker: " << std::hex << uint64_t(t) << L" " << uint64_t(text[0]) << std::endl;
+        if (t == CommentPhaseToken::PlainCharacter) h(wcharToUint64(text[0]), text);
+        if (t == CommentPhaseToken::MultiLineComment) h(' ', text);
+        if (t == CommentPhaseToken::SingleLineComment) h(' ', text);
+        if (t == CommentPhaseToken::CharacterLiteral)
+            for (auto& c : text) h(wcharToUint64(c), TokenText(&c, 1));
+        if ((t == CommentPhaseToken::StringLiteral) || (t == CommentPhaseToken::String))
+            h(String, text);
+        if (t == CommentPhaseToken::StartOfFile) h(StartOfFile, text);
+        if (t == CommentPhaseToken::EndOfFile) h(EndOfFile, text);
+        if (t == CommentPhaseToken::CommentBegin) h(CommentBegin, text);
     }
-    if (t == FirstPhaseToken::String) h(String, text);
-    if (t == FirstPhaseToken::StartOfFile) h(StartOfFile, text);
-    if (t == FirstPhaseToken::EndOfFile) h(EndOfFile, text);
-}
+};
+struct FirstToCommentPhaseLinker
+{
+    template <typename Handler>
+    void operator()(FirstPhaseToken t, TokenText text, const Handler& h) const
+    {
+        //std::wcerr << L"firstAndCommentPhaseLinker: " << std::hex << uint64_t(t) << L" " << text << std::endl;
+        if (t == FirstPhaseToken::PlainCharacter) h(wcharToUint64(text[0]), text);
+        if (t == FirstPhaseToken::MultiLineCommentStart) h(CommentBegin, text);
+        if (t == FirstPhaseToken::UniversalCharacterTuple)
+        {
+            uint64_t aux = 0;
+            for (unsigned i = 2; i < text.size(); ++i)
+                aux = (aux << 4) + HexCharToValue(text[i]);
+            wchar_t c = toWideCharInUtf8(aux);
+            //std::wcerr << text << L": " << std::hex << wcharToUint64(c) << L" " << std::wstring({c}) << std::endl;
+            h(wcharToUint64(c), TokenText(&c, 1));
+        }
+        if (t == FirstPhaseToken::UniversalCharacter)
+        {
+            uint64_t aux = 0;
+            for (unsigned i = 0; i < text.size(); ++i)
+                aux = (aux << 8) + wcharToUint64(text[i]);
+            wchar_t c = wchar_t(aux);
+            h(aux, TokenText(&c, 1));
+        }
+        if (t == FirstPhaseToken::String) h(String, text);
+        if (t == FirstPhaseToken::StartOfFile) h(StartOfFile, text);
+        if (t == FirstPhaseToken::EndOfFile) h(EndOfFile, text);
+    }
+};
 
 struct RawStringProcessor
 {
@@ -235,49 +256,53 @@ struct RawStringProcessor
     }
 };
 
-void prephaseLinker(PrephaseToken t, std::wstring text, Handler h)
+struct PreToFirstPhaseLinker
 {
-    static RawStringProcessor rawStringProcessor;
-    static bool isRawString = false;
-    //std::wcerr << L"prephaseLinker: " << std::hex << uint64_t(t) << L" " << text << L" " << isRawString << std::endl;
-
-    if (isRawString)
+    template <typename Handler>
+    void operator()(PrephaseToken t, TokenText text, const Handler& h) const
     {
-        bool finished = false;
-        for (auto c : text) finished = rawStringProcessor.process(c);
-        if (finished)
+        static RawStringProcessor rawStringProcessor;
+        static bool isRawString = false;
+        //std::wcerr << L"prephaseLinker: " << std::hex << uint64_t(t) << L" " << text << L" " << isRawString << std::endl;
+
+        if (isRawString)
         {
-            h(String, rawStringProcessor.rawString);
-            isRawString = false;
+            bool finished = false;
+            for (auto c : text) finished = rawStringProcessor.process(c);
+            if (finished)
+            {
+                h(String, rawStringProcessor.rawString);
+                isRawString = false;
+            }
         }
-    }
-    else if (t == PrephaseToken::PlainCharacter)
-    {
-        h(wcharToUint64(text[0]), text);
-    }
-    else if (t == PrephaseToken::Trigraph)
-    {
-        switch(text[text.size() - 1])
+        else if (t == PrephaseToken::PlainCharacter)
         {
-            case L'=': h(L'#', L"#"); break;
-            case L'/': h(L'\\', L"\\"); break;
-            case L'\'': h(L'^', L"^"); break;
-            case L'(': h(L'[', L"["); break;
-            case L')': h(L']', L"]"); break;
-            case L'!': h(L'|', L"|"); break;
-            case L'<': h(L'{', L"{"); break;
-            case L'>': h(L'}', L"}"); break;
-            case L'-': h(L'~', L"~"); break;
+            h(wcharToUint64(text[0]), text);
         }
+        else if (t == PrephaseToken::Trigraph)
+        {
+            switch(text[text.size() - 1])
+            {
+                case L'=': h(L'#', L"#"); break;
+                case L'/': h(L'\\', L"\\"); break;
+                case L'\'': h(L'^', L"^"); break;
+                case L'(': h(L'[', L"["); break;
+                case L')': h(L']', L"]"); break;
+                case L'!': h(L'|', L"|"); break;
+                case L'<': h(L'{', L"{"); break;
+                case L'>': h(L'}', L"}"); break;
+                case L'-': h(L'~', L"~"); break;
+            }
+        }
+        else if (t == PrephaseToken::RawString)
+        {
+            isRawString = true;
+            rawStringProcessor.reset();
+        }
+        else if (t == PrephaseToken::StartOfFile) h(StartOfFile, text);
+        else if (t == PrephaseToken::EndOfFile) h(EndOfFile, text);
     }
-    else if (t == PrephaseToken::RawString)
-    {
-        isRawString = true;
-        rawStringProcessor.reset();
-    }
-    else if (t == PrephaseToken::StartOfFile) h(StartOfFile, text);
-    else if (t == PrephaseToken::EndOfFile) h(EndOfFile, text);
-}
+};
 
 std::vector<std::wstring> ops = {
     L"{", L"}", L"[", L"]", L"#", L"##", L"(", L")", L"<:", L":>", L"<%", L"%>", L"%:", L"%:%:",
@@ -287,6 +312,17 @@ std::vector<std::wstring> ops = {
     L"--", L",", L"->*", L"->", L"and", L"and_eq", L"bitand", L"bitor", L"compl", L"not",
     L"not_eq", L"or", L"or_eq", L"xor", L"xor_eq"
 };
+typedef PipelinedTokenizerChain<
+    uint64_t,
+    TokenHandler,
+    std::pair<InitialLinker, PrephaseDefinitions>,
+    std::pair<PreToFirstPhaseLinker, FirstPhaseDefinitions>,
+    std::pair<FirstToCommentPhaseLinker, CommentPhaseDefinitions>,
+    std::pair<CommentToSecondPhaseLinker, SecondPhaseDefinitions>> ChainedTokenizer;
+
+const std::size_t InputBlockSize = 4096;
+const std::vector<std::string> stageNames = {"prephase", "first phase", "comment phase", "token phase"};
+
 std::wstring stringLiteralPostfixChars = L" ()\\" + std::wstring({wchar_t(0), L'-', wchar_t(37)});
 
 } //namespace
@@ -308,9 +344,14 @@ struct PPTokenizer::PPTokenizerImpl
     Rule stringLiteralContent;
     Rule charLiteralContent;
 
-    ChainedTokenizer tokenizerChain;
+    ChainedTokenizer::type tokenizerChain;
 
-    PPTokenizerImpl(std::shared_ptr<IPPTokenStream> output)
+    typedef std::pair<uint64_t, TokenText> Input;
+    std::wstring blockText;
+    std::vector<RecognizedToken<uint64_t>> block;
+    Pipeline pipeline;
+
+    PPTokenizerImpl(std::shared_ptr<IPPTokenStream> output, bool pipelined)
         : output(output),
           started(false),
           identifierNondigitChar(chsetFromRanges(convertToWide(AnnexE1_Allowed_RangesSorted)) | chset(L"a-zA-Z_")),
@@ -324,10 +365,10 @@ struct PPTokenizer::PPTokenizerImpl
           startOfFile(chset(StartOfFile)),
           stringLiteralContent(*(~chset(L"\\\"") | (L"\\" >> anychar) | chset(CommentBegin))),
           charLiteralContent(*(~chset(L"\\'") | (L"\\" >> anychar) | chset(CommentBegin))),
-          tokenizerChain(
-              std::bind(tokenHandler, std::placeholders::_1, std::placeholders::_2, output),
+          tokenizerChain(ChainedTokenizer::make(
+              TokenHandler{output},
               std::pair<InitialLinker, PrephaseDefinitions>(
-                  [](uint64_t c, std::wstring text, Handler h) { h(c, text); },
+                  InitialLinker(),
                   {
                       {PrephaseToken::Trigraph, L"??" >> chset(L"=/'()!<>-")},
                       {PrephaseToken::RawString, chseq(L"R\"") },
@@ -337,7 +378,7 @@ struct PPTokenizer::PPTokenizerImpl
                   }
               ),
               std::pair<PreToFirstPhaseLinker, FirstPhaseDefinitions>(
-                  prephaseLinker,
+                  PreToFirstPhaseLinker(),
                   {
                       {FirstPhaseToken::EscapedLineBreak, chseq(L"\\\n")},
                       {FirstPhaseToken::UniversalCharacterTuple, L"\\" >> ((L"u" >> hexquad) | (L"U" >> hexquad >> hexquad))},
@@ -353,7 +394,7 @@ struct PPTokenizer::PPTokenizerImpl
                   }
               ),
               std::pair<FirstToCommentPhaseLinker, CommentPhaseDefinitions>(
-                  firstAndCommentPhaseLinker,
+                  FirstToCommentPhaseLinker(),
                   {
                       {CommentPhaseToken::SingleLineComment, L"//" >> *~chset(L"\n")},
                       {CommentPhaseToken::MultiLineComment, chset(CommentBegin) >> *(~chset(L"*") | (L"*" >> ~chset(L"/"))) >> L"*/"},
@@ -367,7 +408,7 @@ struct PPTokenizer::PPTokenizerImpl
                   }
               ),
               std::pair<CommentToSecondPhaseLinker, SecondPhaseDefinitions>(
-                  commentAndSecondPhaseLinker,
+                  CommentToSecondPhaseLinker(),
                   {
                       {Token::PPNumber, (chset(L"0-9") | (L"." >> chset(L"0-9")))
                                         >> *(*chset(L"a-zA-Z0-9._") >>  *(chset(L"eE") >> chset(L"-+")))},
@@ -387,15 +428,63 @@ struct PPTokenizer::PPTokenizerImpl
                         (chset(String) | ((chseq(L"u8") | chset(L"uUL")) >> chset(String))) >> !identifier}
                   }
               )
-          )
+          ))
     {
         //for (auto r : identifierNondigitChar.chset.ranges)
             //std::wcerr << std::hex << r.first << L"-" << r.second << std::endl;
+        if (pipelined) pipeline.start(tokenizerChain);
     }
 
     void handle(uint64_t c)
     {
-        tokenizerChain.handler(c, {wchar_t(c)});
+        wchar_t text = wchar_t(c);
+        Input input(c, TokenText(&text, 1));
+        tokenizerChain.processBlock(&input, 1);
+    }
+    // a failed stage of the pipeline is reported with the input at hand,
+    // not only at the end of the file
+    void checkPipeline()
+    {
+        if (pipeline.failed()) pipeline.finish();
+    }
+    void finish()
+    {
+        if (pipeline.running())
+        {
+            pipeline.finish();
+            if (StateMachine::report) pipeline.report(*StateMachine::report, stageNames);
+        }
+        if (StateMachine::report) reportDispatch(*StateMachine::report);
+        output->emit_eof();
+    }
+    void reportDispatch(std::ostream& out)
+    {
+        std::vector<DispatchCounts> counts;
+        collectDispatchCounts(tokenizerChain, counts);
+        for (unsigned i = 0; i < counts.size(); ++i)
+            out << "dispatch " << ((i < stageNames.size()) ? stageNames[i] : std::to_string(i)) << ": "
+                << counts[i].first << " definitions spawned, " << counts[i].second << " skipped" << std::endl;
+    }
+    // the input is split into blocks of bounded size, which keeps the
+    // windows of the stages small on large inputs
+    void processBlock(const unsigned char* data, std::size_t n)
+    {
+        if (n == 0) return;
+        if (not started)
+        {
+            handle(StartOfFile);
+            started = true;
+        }
+        for (std::size_t begin = 0; begin < n; begin += InputBlockSize)
+        {
+            std::size_t size = std::min(InputBlockSize, n - begin);
+            blockText.assign(data + begin, data + begin + size);
+            block.clear();
+            for (std::size_t i = 0; i < size; ++i)
+                block.push_back({data[begin + i], i, 1});
+            tokenizerChain.processOwned(block, blockText, blockText.size());
+            checkPipeline();
+        }
     }
     void process(uint64_t c)
     {
@@ -405,21 +494,27 @@ struct PPTokenizer::PPTokenizerImpl
             started = true;
             if (c == EndOfFile)
             {
-                output->emit_eof();
+                finish();
                 return;
             }
         }
         handle(c);
         if (c == EndOfFile)
         {
-            output->emit_eof();
+            finish();
             return;
         }
+        checkPipeline();
     }
 };
 
 PPTokenizer::PPTokenizer(std::shared_ptr<IPPTokenStream> output)
-    : output(output), impl(new PPTokenizerImpl(output))
+    : PPTokenizer(output, std::getenv("CPPGM_PIPELINE") != nullptr)
+{
+}
+
+PPTokenizer::PPTokenizer(std::shared_ptr<IPPTokenStream> output, bool pipelined)
+    : output(output), impl(new PPTokenizerImpl(output, pipelined))
 {
 }
 
@@ -428,3 +523,8 @@ void PPTokenizer::process(uint64_t c)
     impl->process(c);
 }
 
+void PPTokenizer::processBlock(const unsigned char* data, std::size_t n)
+{
+    impl->processBlock(data, n);
+}
+
@@ -2,6 +2,7 @@
 
 #include "IPPTokenStream.h"
 #include <memory>
+#include <cstddef>
 
 // Translation features you need to implement:
 // - utf8 decoder
@@ -21,7 +22,15 @@ class PPTokenizer
     std::shared_ptr<PPTokenizerImpl> impl;
 
 public:
+	// pipelined when CPPGM_PIPELINE is set
 	PPTokenizer(std::shared_ptr<IPPTokenStream> output);
+	// a pipelined tokenizer runs each phase on a thread of its own, the
+	// output is the same; with CPPGM_AUTOMATA_REPORT set the utilization
+	// of the phases is reported at the end of the file, for any tokenizer
+	// with the definitions its first-character dispatch spawned and skipped
+	PPTokenizer(std::shared_ptr<IPPTokenStream> output, bool pipelined);
 	void process(uint64_t c);
+	// same as process() for each of the n code units
+	void processBlock(const unsigned char* data, std::size_t n);
 };
 
@@ -0,0 +1,109 @@
+#include "Pipeline.hpp"
+#include <chrono>
+#include <algorithm>
+
+PipelineStageBase::PipelineStageBase()
+    : busySeconds(0),
+      blockedSeconds(0),
+      totalSeconds(0),
+      batches(0),
+      items(0),
+      started(false),
+      closing(false),
+      failure(false)
+{
+}
+
+PipelineStageBase::PipelineStageBase(const PipelineStageBase&) : PipelineStageBase()
+{
+}
+
+PipelineStageBase::~PipelineStageBase()
+{
+}
+
+void PipelineStageBase::start()
+{
+    started = true;
+    thread = std::thread(&PipelineStageBase::run, this);
+}
+
+void PipelineStageBase::finish()
+{
+    if (not thread.joinable()) return;
+    closing.store(true, std::memory_order_release);
+    thread.join();
+    started = false;
+}
+
+void PipelineStageBase::wait(unsigned& attempts)
+{
+    if (++attempts < 64) std::this_thread::yield();
+    else std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+void PipelineStageBase::fail(std::exception_ptr error)
+{
+    firstError = error;
+    failure.store(true, std::memory_order_release);
+}
+
+// closing is read before looking for a batch, everything queued before
+// it was set is then still consumed
+void PipelineStageBase::run()
+{
+    auto begin = std::chrono::steady_clock::now();
+    unsigned attempts = 0;
+    while (true)
+    {
+        bool closed = closing.load(std::memory_order_acquire);
+        if (consume())
+        {
+            attempts = 0;
+            continue;
+        }
+        if (closed) break;
+        wait(attempts);
+    }
+    totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+bool Pipeline::running() const
+{
+    return not stages.empty() && stages.front()->running();
+}
+
+bool Pipeline::failed() const
+{
+    for (auto stage : stages)
+        if (stage->failed()) return true;
+    return false;
+}
+
+void Pipeline::finish()
+{
+    std::exception_ptr error;
+    for (auto stage : stages)
+    {
+        stage->finish();
+        if (stage->failed()) error = stage->error();
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+// time a stage spent blocked on the queue of the next one is not counted
+// as busy
+void Pipeline::report(std::ostream& out, const std::vector<std::string>& names) const
+{
+    for (unsigned i = 0; i < stages.size(); ++i)
+    {
+        const PipelineStageBase& stage = *stages[i];
+        double blocked = (i + 1 < stages.size()) ? stages[i + 1]->blockedSeconds : 0;
+        double busy = std::max(stage.busySeconds - blocked, 0.0);
+        double utilization = (stage.totalSeconds > 0) ? busy / stage.totalSeconds : 0;
+        out << "pipeline " << ((i < names.size()) ? names[i] : std::to_string(i)) << ": "
+            << stage.batches << " batches, " << stage.items << " items, busy "
+            << busy << " of " << stage.totalSeconds << " s (" << unsigned(utilization * 100 + 0.5)
+            << "%), blocked " << blocked << " s" << std::endl;
+    }
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "Lexer.hpp"
+#include "SpscRing.hpp"
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// thread of a pipeline stage, consuming what was queued for it until it is
+// finished; a stage which throws keeps the first error and drops the rest
+// of its input, so the stages feeding it never block on it
+class PipelineStageBase
+{
+public:
+    PipelineStageBase();
+    // copies are made while a chain is built, before it is started
+    PipelineStageBase(const PipelineStageBase&);
+    virtual ~PipelineStageBase();
+
+    void start();
+    // returns once everything queued was consumed
+    void finish();
+    bool running() const { return started; }
+    bool failed() const { return failure.load(std::memory_order_acquire); }
+    std::exception_ptr error() const { return firstError; }
+
+    // statistics of a finished stage; blockedSeconds is the time the stage
+    // before spent waiting for room in the queue of this one
+    double busySeconds;
+    double blockedSeconds;
+    double totalSeconds;
+    unsigned long batches;
+    unsigned long items;
+
+    // backs off while a ring is full or empty
+    static void wait(unsigned& attempts);
+
+protected:
+    // processes the batch at the front, false when there is none
+    virtual bool consume() = 0;
+    void fail(std::exception_ptr error);
+
+private:
+    std::thread thread;
+    bool started;
+    std::atomic<bool> closing;
+    std::atomic<bool> failure;
+    std::exception_ptr firstError;
+
+    void run();
+};
+
+// boundary in front of a chain link: blocks passed to it are handed to next
+// right away, or once started are queued for the thread of the stage; a
+// full queue holds the producer back. Tokens with the buffer holding their
+// text are queued by swapping them into a slot, whose previous buffers go
+// back to the producer to be reused, so their text is not copied
+template <typename InType, typename Next>
+struct PipelineStage : PipelineStageBase
+{
+    static const std::size_t Capacity = 8;
+
+    typedef std::pair<InType, TokenText> Input;
+    typedef std::vector<RecognizedToken<InType>> Tokens;
+    struct Batch
+    {
+        Tokens tokens;
+        std::wstring text;
+    };
+
+    Next next;
+    std::unique_ptr<SpscRing<Batch>> ring;
+    std::vector<Input> views;
+
+    PipelineStage(Next next) : next(next), ring(new SpscRing<Batch>(Capacity)) {}
+    PipelineStage(const PipelineStage& other)
+        : PipelineStageBase(other), next(other.next), ring(new SpscRing<Batch>(Capacity))
+    {}
+    ~PipelineStage() { finish(); }
+
+    // tokens viewing text which stays with the caller are copied
+    void processBlock(const Input* tokens, std::size_t count)
+    {
+        if (not running())
+        {
+            passBlock(next, tokens, count);
+            return;
+        }
+        Batch* batch = slot();
+        batch->tokens.clear();
+        batch->text.clear();
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            batch->tokens.push_back({tokens[i].first, batch->text.size(), tokens[i].second.size()});
+            batch->text.append(tokens[i].second.begin(), tokens[i].second.size());
+        }
+        ring->push();
+    }
+
+    // tokens at offsets into text; text from keepFrom on stays with the
+    // caller, which gets buffers to reuse back
+    void processOwned(Tokens& tokens, std::wstring& text, std::size_t keepFrom)
+    {
+        if (not running())
+        {
+            passBlock(next, viewsOf(tokens, text), tokens.size());
+            return;
+        }
+        Batch* batch = slot();
+        batch->tokens.swap(tokens);
+        batch->text.swap(text);
+        text.assign(batch->text, keepFrom, std::wstring::npos);
+        ring->push();
+    }
+
+protected:
+    bool consume()
+    {
+        Batch* batch = ring->front();
+        if (not batch) return false;
+        if (not failed())
+        {
+            auto begin = std::chrono::steady_clock::now();
+            try
+            {
+                passBlock(next, viewsOf(batch->tokens, batch->text), batch->tokens.size());
+            }
+            catch (...)
+            {
+                fail(std::current_exception());
+            }
+            busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        }
+        ++batches;
+        items += batch->tokens.size();
+        ring->pop();
+        return true;
+    }
+
+private:
+    Batch* slot()
+    {
+        Batch* batch = ring->back();
+        if (batch) return batch;
+        auto begin = std::chrono::steady_clock::now();
+        unsigned attempts = 0;
+        while (not (batch = ring->back())) wait(attempts);
+        blockedSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        return batch;
+    }
+
+    const Input* viewsOf(const Tokens& tokens, const std::wstring& text)
+    {
+        views.clear();
+        for (auto& token : tokens)
+            views.push_back(Input(token.token, TokenText(text.data() + token.offset, token.length)));
+        return views.data();
+    }
+};
+
+template <typename InType, typename Next>
+const std::size_t PipelineStage<InType, Next>::Capacity;
+
+template <typename InType, typename Next, typename TokenType>
+void passBlock(PipelineStage<InType, Next>& stage, const std::pair<TokenType, TokenText>* tokens, std::size_t count)
+{
+    stage.processBlock(tokens, count);
+}
+
+// a running stage takes the window of the machine with the tokens in it
+template <typename InType, typename Next>
+void passTokens(PipelineStage<InType, Next>& stage, TokenizerMachine<InType>& machine,
+                std::vector<std::pair<InType, TokenText>>& block)
+{
+    if (not stage.running())
+    {
+        tokenViews(machine, block);
+        stage.processBlock(block.data(), block.size());
+        machine.flush();
+        return;
+    }
+    stage.processOwned(machine.recognized, machine.window, machine.windowStart);
+    machine.handedOff();
+}
+
+template <typename Handler>
+void collectPipelineStages(Handler&, std::vector<PipelineStageBase*>&);
+template <typename Linker, typename OutType, typename Next>
+void collectPipelineStages(StaticTokenizerChainLink<Linker, OutType, Next>& link, std::vector<PipelineStageBase*>& out);
+template <typename InType, typename Next>
+void collectPipelineStages(PipelineStage<InType, Next>& stage, std::vector<PipelineStageBase*>& out);
+
+template <typename Handler>
+void collectPipelineStages(Handler&, std::vector<PipelineStageBase*>&)
+{
+}
+
+template <typename Linker, typename OutType, typename Next>
+void collectPipelineStages(StaticTokenizerChainLink<Linker, OutType, Next>& link, std::vector<PipelineStageBase*>& out)
+{
+    collectPipelineStages(link.next, out);
+}
+
+template <typename InType, typename Next>
+void collectPipelineStages(PipelineStage<InType, Next>& stage, std::vector<PipelineStageBase*>& out)
+{
+    out.push_back(&stage);
+    collectPipelineStages(stage.next, out);
+}
+
+template <typename InType, typename Next>
+void collectDispatchCounts(PipelineStage<InType, Next>& stage, std::vector<DispatchCounts>& out)
+{
+    collectDispatchCounts(stage.next, out);
+}
+
+// stages of a chain, started and finished together
+class Pipeline
+{
+    std::vector<PipelineStageBase*> stages;
+
+public:
+    template <typename Chain>
+    void start(Chain& chain)
+    {
+        collectPipelineStages(chain, stages);
+        for (auto stage : stages) stage->start();
+    }
+
+    bool running() const;
+    bool failed() const;
+    // finishes the stages in the order of the chain and rethrows the error
+    // of the last stage which failed: the stages after a failed one only
+    // got input from before the error, so that one came first in the input
+    void finish();
+    // utilization of the stages, one line per stage with the given names
+    void report(std::ostream& out, const std::vector<std::string>& names) const;
+};
+
+// chain like StaticTokenizerChain with a pipeline stage in front of every
+// link, its first stage takes blocks of InType
+template <typename InType, typename FinalHandler, typename... Links>
+struct PipelinedTokenizerChain
+{
+    typedef FinalHandler type;
+
+    static type make(FinalHandler finalHandler)
+    {
+        return finalHandler;
+    }
+};
+
+template <typename InType, typename FinalHandler, typename Linker, typename OutType, typename... Links>
+struct PipelinedTokenizerChain<InType, FinalHandler, std::pair<Linker, std::vector<std::pair<OutType, Rule>>>, Links...>
+{
+    typedef PipelinedTokenizerChain<OutType, FinalHandler, Links...> Tail;
+    typedef StaticTokenizerChainLink<Linker, OutType, typename Tail::type> Link;
+    typedef PipelineStage<InType, Link> type;
+
+    static type make(FinalHandler finalHandler,
+                     const std::pair<Linker, std::vector<std::pair<OutType, Rule>>>& linkData,
+                     const Links& ...tailLinksData)
+    {
+        return type(Link(linkData.first, linkData.second, Tail::make(finalHandler, tailLinksData...)));
+    }
+};
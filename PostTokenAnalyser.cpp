@@ -2,7 +2,7 @@
 #include "StandardData.hpp"
 #include "Helpers.hpp"
 #include "RegexRule.hpp"
-#include "StateMachine.hpp"
+#include "StaticRule.hpp"
 #include <vector>
 #include <algorithm>
 #include <iostream>
@@ -11,6 +11,17 @@
 namespace
 {
 
+// rule() of a static optional interns to the node runtime ! builds, alone
+// and followed by more; checked once at startup
+const bool staticOptionalsChecked = []
+{
+    Rule a = chset(L'a');
+    Rule b = chset(L'b');
+    assert((!staticChars<'a'>()).rule() == !a);
+    assert(((!staticChars<'a'>()) >> staticChars<'b'>()).rule() == (!a >> b));
+    return true;
+}();
+
 bool isToBigOctal(const std::string& val)
 {
     if (val.size() > 22) return true;
@@ -152,14 +163,18 @@ void PostTokenAnalyser::emit_pp_number(const string& data)
     auto value = prefix.substr(index);
     auto isUnsigned = ((value.size() == 22) && (value[0] == '1'));
 
-    auto longSuffix = chset(L"lL");
-    auto longLongSuffix = Rule(L"ll") | L"LL";
-    auto unsignedSuffix = chset(L"uU");
-    auto unsignedLongSuffix = (chset(L"Uu") >> chset(L"lL")) | (chset(L"lL") >> chset(L"Uu"));
-    auto unsignedLongLongSuffix = (chset(L"Uu") >> longLongSuffix) | (longLongSuffix >> chset(L"Uu"));
-    auto userDefinedSuffix = L"_" >> chset(L"a-zA-Z") >> *chset(L"a-zA-Z0-9_");
-    auto eNotation = chset(L"eE") >> ((chset(L"+-") >> +chset(L"0-9")) | +chset(L"0-9"));
-    auto floatSuffix = chset(L"fF") | (eNotation >> chset(L"fF"));
+    constexpr auto digit = staticRange<'0', '9'>();
+    constexpr auto letter = staticRange<'a', 'z'>() | staticRange<'A', 'Z'>();
+    constexpr auto longSuffix = staticChars<'l', 'L'>();
+    constexpr auto longLongSuffix = staticString<'l', 'l'>() | staticString<'L', 'L'>();
+    constexpr auto unsignedSuffix = staticChars<'u', 'U'>();
+    constexpr auto unsignedLongSuffix = (staticChars<'U', 'u'>() >> staticChars<'l', 'L'>())
+        | (staticChars<'l', 'L'>() >> staticChars<'U', 'u'>());
+    constexpr auto unsignedLongLongSuffix = (staticChars<'U', 'u'>() >> longLongSuffix)
+        | (longLongSuffix >> staticChars<'U', 'u'>());
+    constexpr auto userDefinedSuffix = staticChars<'_'>() >> letter >> *(letter | digit | staticChars<'_'>());
+    constexpr auto eNotation = staticChars<'e', 'E'>() >> ((staticChars<'+', '-'>() >> +digit) | +digit);
+    constexpr auto floatSuffix = staticChars<'f', 'F'>() | (eNotation >> staticChars<'f', 'F'>());
 
     auto dots = std::count(prefix.begin(), prefix.end(), '.');
 
@@ -167,31 +182,31 @@ void PostTokenAnalyser::emit_pp_number(const string& data)
     {
         if (suffix.empty())
             emitIntLiteral<int>(data, value, isHex, isOctet, isUnsigned, output);
-        else if (matches(longSuffix, suffix))
+        else if (longSuffix.fullMatch(suffix))
             emitIntLiteral<long int>(data, value, isHex, isOctet, isUnsigned, output);
-        else if (matches(longLongSuffix, suffix))
+        else if (longLongSuffix.fullMatch(suffix))
             emitIntLiteral<long long int>(data, value, isHex, isOctet, isUnsigned, output);
-        else if (matches(unsignedSuffix, suffix))
+        else if (unsignedSuffix.fullMatch(suffix))
             emitIntLiteral<unsigned int>(data, value, isHex, isOctet, true, output);
-        else if (matches(unsignedLongSuffix, suffix))
+        else if (unsignedLongSuffix.fullMatch(suffix))
             emitIntLiteral<unsigned long int>(data, value, isHex, isOctet, true, output);
-        else if (matches(unsignedLongLongSuffix, suffix))
+        else if (unsignedLongLongSuffix.fullMatch(suffix))
             emitIntLiteral<unsigned long long int>(data, value, isHex, isOctet, true, output);
-        else if (matches(eNotation, suffix))
+        else if (eNotation.fullMatch(suffix))
             emitFloatLiteral<double>(data, output);
-        else if (matches(floatSuffix, suffix))
+        else if (floatSuffix.fullMatch(suffix))
             emitFloatLiteral<float>(data, output);
-        else if (matches(userDefinedSuffix, suffix))
+        else if (userDefinedSuffix.fullMatch(suffix))
             emitUserDefinedNumber(data, prefix, suffix, isOctet, isHex, false, output);
-        else if (matches(eNotation >> userDefinedSuffix, suffix))
+        else if ((eNotation >> userDefinedSuffix).fullMatch(suffix))
             emitUserDefinedNumber(data, prefix, suffix, isOctet, isHex, true, output);
         else output->emit_invalid(data);
     }
-    else if ((dots < 2) && (suffix.empty() || matches(eNotation, suffix)))
+    else if ((dots < 2) && (suffix.empty() || eNotation.fullMatch(suffix)))
         emitFloatLiteral<double>(data, output);
-    else if ((dots < 2) && matches(floatSuffix, suffix))
+    else if ((dots < 2) && floatSuffix.fullMatch(suffix))
         emitFloatLiteral<float>(data, output);
-    else if (matches(userDefinedSuffix | (eNotation >> userDefinedSuffix), suffix))
+    else if ((userDefinedSuffix | (eNotation >> userDefinedSuffix)).fullMatch(suffix))
         emitUserDefinedNumber(data, prefix, suffix, isOctet, isHex, true, output);
     else output->emit_invalid(data);
 }
@@ -2,9 +2,37 @@
 #include "Helpers.hpp"
 #include <iostream>
 #include <limits>
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
 
-Chset::Chset(std::wstring chset)
+namespace
 {
+
+CharRanges normalized(CharRanges ranges)
+{
+    std::sort(ranges.begin(), ranges.end());
+    CharRanges out;
+    for (auto range : ranges)
+    {
+        if (range.first > range.second) continue;
+        if (not out.empty()
+            && (out.back().second != std::numeric_limits<uint64_t>::max())
+            && (range.first <= out.back().second + 1))
+        {
+            out.back().second = std::max(out.back().second, range.second);
+            continue;
+        }
+        if (not out.empty() && (range.first <= out.back().second)) continue;
+        out.push_back(range);
+    }
+    return out;
+}
+
+CharRanges parseRanges(const std::wstring& chset)
+{
+    CharRanges out;
     unsigned index = 0;
     while (index < chset.size())
     {
@@ -17,94 +45,222 @@ Chset::Chset(std::wstring chset)
             range.second = wcharToUint64(chset[index]);
             ++index;
         }
-        ranges.insert(range);
+        out.push_back(range);
     }
+    return out;
 }
 
-Chset::Chset(std::vector<std::pair<int, int>> intRanges)
+CharRanges convertRanges(const std::vector<std::pair<int, int>>& intRanges)
 {
+    CharRanges out;
     for (auto range : intRanges)
-        ranges.insert({range.first & MAX_ANYCHAR, range.second & MAX_ANYCHAR});
+        out.push_back({range.first & MAX_ANYCHAR, range.second & MAX_ANYCHAR});
+    return out;
+}
+
+void hashValue(uint64_t& hash, uint64_t value)
+{
+    for (unsigned i = 0; i < sizeof(value); ++i)
+    {
+        hash ^= (value >> (8 * i)) & 0xff;
+        hash *= 0x100000001b3ull;
+    }
+}
+
+// subrules are interned already, so the fingerprint of a node is built
+// from theirs and nodes are equal when their subrules are the same nodes
+uint64_t fingerprintOf(Rule::Type d, const Rules& subrules, const Chset& chset)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hashValue(hash, uint64_t(d));
+    hashValue(hash, subrules.size());
+    hashValue(hash, chset.ranges.size());
+    for (auto range : chset.ranges)
+    {
+        hashValue(hash, range.first);
+        hashValue(hash, range.second);
+    }
+    for (auto& subrule : subrules)
+        hashValue(hash, fingerprint(subrule));
+    return hash;
 }
 
+typedef std::vector<std::weak_ptr<const RuleNode>> InternedNodes;
+
+std::mutex internedMutex;
+std::unordered_map<uint64_t, InternedNodes>& interned()
+{
+    static std::unordered_map<uint64_t, InternedNodes> nodes;
+    return nodes;
+}
+
+// freed nodes are dropped when their bucket is searched, and all at once
+// whenever the table doubled since the last sweep
+void sweepInterned()
+{
+    static std::size_t swept = 0;
+    auto& nodes = interned();
+    if (nodes.size() < 2 * swept + 1024) return;
+    for (auto it = nodes.begin(); it != nodes.end();)
+    {
+        InternedNodes& candidates = it->second;
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                        [](const std::weak_ptr<const RuleNode>& node) { return node.expired(); }),
+                         candidates.end());
+        it = candidates.empty() ? nodes.erase(it) : std::next(it);
+    }
+    swept = nodes.size();
+}
+
+std::shared_ptr<const RuleNode> intern(Rule::Type d, const Rules& subrules, const Chset& chset)
+{
+    uint64_t hash = fingerprintOf(d, subrules, chset);
+    std::lock_guard<std::mutex> lock(internedMutex);
+    sweepInterned();
+    InternedNodes& candidates = interned()[hash];
+    for (auto it = candidates.begin(); it != candidates.end();)
+    {
+        auto node = it->lock();
+        if (not node)
+        {
+            it = candidates.erase(it);
+            continue;
+        }
+        if ((node->discriminator == d) && (node->subrules == subrules) && (node->chset.ranges == chset.ranges))
+            return node;
+        ++it;
+    }
+    auto node = std::make_shared<const RuleNode>(RuleNode{d, subrules, chset, hash});
+    candidates.push_back(node);
+    return node;
+}
+
+typedef std::vector<std::wstring>::const_iterator Strings;
+
+// strings are sorted, unique and share their first depth characters; each
+// character is followed by the trie of the suffixes starting with it, so
+// common prefixes are matched once
+Rule trie(Strings begin, Strings end, std::size_t depth)
+{
+    Rules alternatives;
+    std::vector<uint64_t> lastChars;
+    while (begin != end)
+    {
+        wchar_t c = (*begin)[depth];
+        Strings groupEnd = begin;
+        while ((groupEnd != end) && ((*groupEnd)[depth] == c)) ++groupEnd;
+        bool endsHere = (begin->size() == depth + 1);
+        Strings longer = endsHere ? begin + 1 : begin;
+        if (longer == groupEnd)
+            lastChars.push_back(wcharToUint64(c));
+        else
+        {
+            Rule suffixes = trie(longer, groupEnd, depth + 1);
+            // the empty alternative goes first so a following rule is
+            // attached to its transition
+            if (endsHere) suffixes = Rule(Rule::Type::DOrSeq, {Rule(Rule::Type::DEmpty), suffixes});
+            Rules sequence({::chset(c)});
+            if (suffixes.discriminator() == Rule::Type::DSeq)
+                sequence.insert(sequence.end(), suffixes.subrules().begin(), suffixes.subrules().end());
+            else sequence.push_back(suffixes);
+            alternatives.push_back(Rule(Rule::Type::DSeq, sequence));
+        }
+        begin = groupEnd;
+    }
+    if (not lastChars.empty()) alternatives.push_back(::chset(lastChars));
+    if (alternatives.size() == 1) return alternatives.front();
+    return Rule(Rule::Type::DOrSeq, alternatives);
+}
+
+template <typename Iterator>
+Rules charactersOf(Iterator begin, Iterator end)
+{
+    Rules out;
+    for (auto it = begin; it != end; ++it) out.push_back(::chset(*it));
+    return out;
+}
+
+} //namespace
+
+bool contains(const CharRanges& ranges, uint64_t c)
+{
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), CharRange(c, std::numeric_limits<uint64_t>::max()));
+    return (it != ranges.begin()) && (c <= (it - 1)->second);
+}
+
+Chset::Chset(CharRanges unsorted) : ranges(normalized(unsorted)), ascii{0, 0}
+{
+    for (auto range : ranges)
+    {
+        if (range.first >= 128) break;
+        for (uint64_t c = range.first; (c <= range.second) && (c < 128); ++c)
+            ascii[c >> 6] |= uint64_t(1) << (c & 63);
+    }
+}
+
+Chset::Chset(std::wstring chset) : Chset(parseRanges(chset)) {}
+
+Chset::Chset(std::vector<std::pair<int, int>> intRanges) : Chset(convertRanges(intRanges)) {}
+
 Chset Chset::operator~() const
 {
-    Chset out;
+    CharRanges out;
     uint64_t prev = MIN_ANYCHAR;
     for (auto range : ranges)
     {
-        if ((range.first >= MIN_ANYCHAR) && (range.first - 1 >= prev))
-            out.ranges.insert({prev, range.first - 1});
+        if (prev > MAX_ANYCHAR) break;
+        if (range.first > prev)
+            out.push_back({prev, std::min<uint64_t>(range.first - 1, MAX_ANYCHAR)});
         prev = std::max(range.second + 1, prev);
     }
     if (prev <= MAX_ANYCHAR)
-        out.ranges.insert({prev, MAX_ANYCHAR});
-    return out;
+        out.push_back({prev, MAX_ANYCHAR});
+    return Chset(out);
 }
 
 Chset Chset::operator-(const Chset& other) const
 {
-    Chset out;
+    CharRanges out;
     auto it = other.ranges.begin();
     for (auto range : ranges)
     {
-        while ((it != other.ranges.end()) && (range.first > it->second))
-            ++it;
-        if (it == other.ranges.end()) out.ranges.insert(range);
-        else if (range.second < it->first) out.ranges.insert(range);
-        else if ((it->first <= range.first) && (it->second >= range.second)) continue;
-        else if ((it->first > range.first) && (it->second < range.second))
-        {
-            if (it->first != std::numeric_limits<decltype(it->first)>::min())
-                out.ranges.insert({range.first, it->first - 1});
-            if (it->second != std::numeric_limits<decltype(it->first)>::max())
-                out.ranges.insert({it->second + 1, range.second});
-        }
-        else if (it->first > range.first)
+        while ((it != other.ranges.end()) && (it->second < range.first)) ++it;
+        uint64_t from = range.first;
+        bool covered = false;
+        for (auto hole = it; not covered && (hole != other.ranges.end()) && (hole->first <= range.second); ++hole)
         {
-            if (it->first != std::numeric_limits<decltype(it->first)>::min())
-                out.ranges.insert({range.first, it->first - 1});
-        }
-        else
-        {
-            if (it->second != std::numeric_limits<decltype(it->first)>::max())
-                out.ranges.insert({it->second + 1, range.second});
+            if (hole->first > from) out.push_back({from, hole->first - 1});
+            if (hole->second >= range.second) covered = true;
+            else from = hole->second + 1;
         }
+        if (not covered) out.push_back({from, range.second});
     }
-    return out;
+    return Chset(out);
 }
 
 Chset operator|(const Chset& left, const Chset& right)
 {
-    Chset out;
-    out.ranges.insert(left.ranges.begin(), left.ranges.end());
-    out.ranges.insert(right.ranges.begin(), right.ranges.end());
-    return out;
+    CharRanges out;
+    std::merge(left.ranges.begin(), left.ranges.end(), right.ranges.begin(), right.ranges.end(),
+               std::back_inserter(out));
+    return Chset(out);
 }
 
-Rule::Rule(Type d) : discriminator(d) {}
+Rule::Rule(Type d) : node(intern(d, {}, Chset())) {}
 
-Rule::Rule(Chset chset) : discriminator(Type::DChset), chset(chset) {}
+Rule::Rule(Chset chset) : node(intern(Type::DChset, {}, chset)) {}
 
-Rule::Rule(Type d, Rules subrules) : discriminator(d), subrules(subrules) {}
+Rule::Rule(Type d, Rules subrules) : node(intern(d, subrules, Chset())) {}
 
-Rule::Rule(const std::wstring& text) : discriminator(Type::DSeq)
-{
-    for (auto c : text) subrules.push_back(::chset(c));
-}
-Rule::Rule(const wchar_t* text) : discriminator(Type::DSeq)
-{
-    auto c = text;
-    while (*c != '\0') subrules.push_back(::chset(*c++));
-}
+Rule::Rule(const std::wstring& text) : Rule(Type::DSeq, charactersOf(text.begin(), text.end())) {}
+
+Rule::Rule(const wchar_t* text) : Rule(std::wstring(text)) {}
 
 Rule Rule::operator>>(const Rule& other) const
 {
-    Rule out(Type::DSeq);
-    if (discriminator == Type::DSeq) out = *this;
-    else out.subrules.push_back(*this);
-    out.subrules.push_back(other);
-    return out;
+    Rules subrules = (discriminator() == Type::DSeq) ? this->subrules() : Rules({*this});
+    subrules.push_back(other);
+    return Rule(Type::DSeq, subrules);
 }
 
 Rule Rule::operator+() const
@@ -119,27 +275,25 @@ Rule Rule::operator*() const
 
 Rule Rule::operator|(const Rule& other) const
 {
-    if ((discriminator == Type::DChset)
-        && (other.discriminator == Type::DChset))
-        return Rule(chset | other.chset);
-    Rule out(Type::DOrSeq);
-    if (discriminator == Type::DOrSeq) out = *this;
-    else out.subrules.push_back(*this);
-    out.subrules.push_back(other);
-    return out;
+    if ((discriminator() == Type::DChset)
+        && (other.discriminator() == Type::DChset))
+        return Rule(chset() | other.chset());
+    Rules subrules = (discriminator() == Type::DOrSeq) ? this->subrules() : Rules({*this});
+    subrules.push_back(other);
+    return Rule(Type::DOrSeq, subrules);
 }
 
 Rule Rule::operator~() const
 {
-    if (discriminator != Type::DChset)
+    if (discriminator() != Type::DChset)
         throw RuleException("only character sets can be negated");
-    return Rule(~chset);
+    return Rule(~chset());
 }
 Rule Rule::operator-(const Rule& other) const
 {
-    if ((discriminator != Type::DChset) || (other.discriminator != Type::DChset))
+    if ((discriminator() != Type::DChset) || (other.discriminator() != Type::DChset))
         throw RuleException("subtract can be perform only on character sets");
-    return Rule(chset - other.chset);
+    return Rule(chset() - other.chset());
 }
 Rule Rule::operator!() const
 {
@@ -167,10 +321,10 @@ Rule chset(uint64_t arg)
 }
 Rule chset(std::vector<uint64_t> arg)
 {
-    Chset chset;
+    CharRanges ranges;
     for (auto elem : arg)
-        chset.ranges.insert({elem, elem});
-    return Rule(chset);
+        ranges.push_back({elem, elem});
+    return Rule(Chset(ranges));
 }
 
 Rule chset(std::wstring chset)
@@ -187,10 +341,9 @@ Rule chseq(std::wstring seq)
 
 Rule strset(std::vector<std::wstring> strs)
 {
-    Rules rules;
-    for (auto str : strs)
-        rules.push_back(chseq(str));
-    return Rule(Rule::Type::DOrSeq, rules);
+    std::sort(strs.begin(), strs.end());
+    strs.erase(std::unique(strs.begin(), strs.end()), strs.end());
+    return trie(strs.begin(), strs.end(), 0);
 }
 
 Rule chsetFromRanges(std::vector<std::pair<int, int>> ranges)
@@ -199,3 +352,25 @@ Rule chsetFromRanges(std::vector<std::pair<int, int>> ranges)
 
 }
 
+uint64_t fingerprint(const Rule& rule)
+{
+    return rule.node->fingerprint;
+}
+
+WeakRules::WeakRules(const Rules& rules)
+{
+    for (auto& rule : rules) nodes.push_back(rule.node);
+}
+
+bool WeakRules::expired() const
+{
+    for (auto& node : nodes)
+        if (node.expired()) return true;
+    return false;
+}
+
+bool WeakRules::operator<(const WeakRules& other) const
+{
+    return std::lexicographical_compare(nodes.begin(), nodes.end(), other.nodes.begin(), other.nodes.end(),
+                                        std::owner_less<std::weak_ptr<const RuleNode>>());
+}
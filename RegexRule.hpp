@@ -2,10 +2,11 @@
 
 #include <vector>
 #include <utility>
-#include <set>
 #include <string>
 #include <stdexcept>
 #include <limits>
+#include <cstdint>
+#include <memory>
 
 #define MAX_ANYCHAR (0xFFFFFFFF)
 #define MIN_ANYCHAR (0)
@@ -13,27 +14,44 @@
 struct Rule;
 typedef std::vector<Rule> Rules;
 typedef std::pair<uint64_t, uint64_t> CharRange;
-typedef std::set<CharRange> CharRanges;
+typedef std::vector<CharRange> CharRanges;
+
+// binary search over sorted disjoint ranges
+bool contains(const CharRanges& ranges, uint64_t c);
 
 struct RuleException : std::runtime_error
 {
     RuleException(std::string what) : std::runtime_error(what) {}
 };
 
+// ranges are sorted, disjoint and not adjacent,
+// characters below 128 are mirrored in a bitmap
 struct Chset
 {
     CharRanges ranges;
+    uint64_t ascii[2];
 
     Chset(std::wstring chset = L"");
     Chset(std::vector<std::pair<int, int>> intRanges);
+    Chset(CharRanges ranges);
     Chset operator~() const;
     Chset operator-(const Chset& other) const;
+
+    bool contains(uint64_t c) const
+    {
+        if (c < 128) return (ascii[c >> 6] >> (c & 63)) & 1;
+        return ::contains(ranges, c);
+    }
 };
 
 Chset operator|(const Chset& left, const Chset& right);
 Rule chset(std::wstring chset);
 Rule chset(wchar_t c);
 
+struct RuleNode;
+
+// rules are handles to immutable nodes interned by structure, so equal
+// subexpressions are stored once and rules compare by identity
 struct Rule
 {
     enum class Type
@@ -44,9 +62,6 @@ struct Rule
         DChset,
         DEmpty
     };
-    Type discriminator;
-    Rules subrules;
-    Chset chset;
 
     Rule(Type d);
     Rule(Chset chset);
@@ -54,6 +69,10 @@ struct Rule
     Rule(const std::wstring& text);
     Rule(const wchar_t* text);
 
+    Type discriminator() const;
+    const Rules& subrules() const;
+    const Chset& chset() const;
+
     Rule operator>>(const Rule& other) const;
     Rule operator+() const;
     Rule operator*() const;
@@ -61,8 +80,41 @@ struct Rule
     Rule operator~() const;
     Rule operator-(const Rule& other) const;
     Rule operator!() const;
+
+    bool operator==(const Rule& other) const { return node == other.node; }
+    bool operator<(const Rule& other) const { return node < other.node; }
+
+private:
+    std::shared_ptr<const RuleNode> node;
+
+    friend uint64_t fingerprint(const Rule& rule);
+    friend class WeakRules;
 };
 
+// key of a cache built from rules which does not keep their nodes alive;
+// once a node is freed the key expires, and since equal rules share their
+// node, nothing can look it up anymore
+class WeakRules
+{
+    std::vector<std::weak_ptr<const RuleNode>> nodes;
+public:
+    WeakRules(const Rules& rules);
+    bool expired() const;
+    bool operator<(const WeakRules& other) const;
+};
+
+struct RuleNode
+{
+    Rule::Type discriminator;
+    Rules subrules;
+    Chset chset;
+    uint64_t fingerprint;
+};
+
+inline Rule::Type Rule::discriminator() const { return node->discriminator; }
+inline const Rules& Rule::subrules() const { return node->subrules; }
+inline const Chset& Rule::chset() const { return node->chset; }
+
 Rule operator>>(const wchar_t* left, const Rule& right);
 Rule operator|(const wchar_t* left, const Rule& right);
 Rule chset(wchar_t c);
@@ -73,4 +125,6 @@ extern Rule anychar;
 Rule chseq(std::wstring seq);
 Rule strset(std::vector<std::wstring> strs);
 Rule chsetFromRanges(std::vector<std::pair<int, int>> ranges);
+// structural hash, equal rules have equal fingerprints
+uint64_t fingerprint(const Rule& rule);
 
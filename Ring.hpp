@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// queue over a power of two array of slots, addressed relative to its
+// front; it only grows when full, so a steady flow of pushes and pops
+// neither allocates nor moves elements
+template <typename T>
+class Ring
+{
+    std::vector<T> slots;
+    std::size_t mask;
+    std::size_t head;
+    std::size_t count;
+
+    void grow()
+    {
+        std::vector<T> bigger(slots.size() * 2);
+        for (std::size_t i = 0; i < count; ++i) bigger[i] = (*this)[i];
+        slots.swap(bigger);
+        mask = slots.size() - 1;
+        head = 0;
+    }
+
+public:
+    explicit Ring(std::size_t capacity = 64) : head(0), count(0)
+    {
+        std::size_t size = 1;
+        while (size < capacity) size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](std::size_t i) { return slots[(head + i) & mask]; }
+    const T& operator[](std::size_t i) const { return slots[(head + i) & mask]; }
+
+    void push_back(const T& value)
+    {
+        if (count == slots.size()) grow();
+        slots[(head + count) & mask] = value;
+        ++count;
+    }
+    void pop_front(std::size_t n)
+    {
+        head = (head + n) & mask;
+        count -= n;
+    }
+    void clear()
+    {
+        head = 0;
+        count = 0;
+    }
+};
@@ -0,0 +1,161 @@
+#include "RuleNormalization.hpp"
+#include <map>
+
+namespace
+{
+
+// the automaton of such a rule has no start state, it is skipped inside
+// sequences and the sequence it begins is skipped as a whole
+bool danglingStart(const Rule& rule)
+{
+    switch (rule.discriminator())
+    {
+        case Rule::Type::DEmpty:
+            return true;
+        case Rule::Type::DSeq:
+        case Rule::Type::DRepeat:
+            return not rule.subrules().empty() && danglingStart(rule.subrules().front());
+        default:
+            return false;
+    }
+}
+
+Rule sequence(const Rules& subrules)
+{
+    if (danglingStart(subrules.front())) return Rule(Rule::Type::DEmpty);
+    Rules out;
+    for (auto& subrule : subrules)
+    {
+        if (not out.empty() && danglingStart(subrule)) continue;
+        if (subrule.discriminator() == Rule::Type::DSeq)
+            out.insert(out.end(), subrule.subrules().begin(), subrule.subrules().end());
+        else out.push_back(subrule);
+    }
+    if (out.size() == 1) return out.front();
+    return Rule(Rule::Type::DSeq, out);
+}
+
+Rule alternation(const Rules& subrules);
+
+Rule tail(const Rule& rule)
+{
+    Rules rest(rule.subrules().begin() + 1, rule.subrules().end());
+    if (rest.size() == 1) return rest.front();
+    return Rule(Rule::Type::DSeq, rest);
+}
+
+Rules factored(const Rules& subrules)
+{
+    std::map<Rule, std::vector<unsigned>> byHead;
+    for (unsigned i = 0; i < subrules.size(); ++i)
+        if (subrules[i].discriminator() == Rule::Type::DSeq)
+            byHead[subrules[i].subrules().front()].push_back(i);
+
+    Rules out;
+    std::vector<bool> taken(subrules.size(), false);
+    for (unsigned i = 0; i < subrules.size(); ++i)
+    {
+        if (taken[i]) continue;
+        if (subrules[i].discriminator() != Rule::Type::DSeq)
+        {
+            out.push_back(subrules[i]);
+            continue;
+        }
+        const Rule& head = subrules[i].subrules().front();
+        const std::vector<unsigned>& group = byHead[head];
+        if (group.size() == 1)
+        {
+            out.push_back(subrules[i]);
+            continue;
+        }
+        Rules tails;
+        for (auto member : group)
+        {
+            taken[member] = true;
+            tails.push_back(tail(subrules[member]));
+        }
+        out.push_back(sequence({head, alternation(tails)}));
+    }
+    return out;
+}
+
+Rule alternation(const Rules& subrules)
+{
+    for (auto& subrule : subrules)
+        if (danglingStart(subrule)) return Rule(Rule::Type::DOrSeq, subrules);
+
+    Rules flattened;
+    for (auto& subrule : subrules)
+    {
+        bool nested = (subrule.discriminator() == Rule::Type::DOrSeq);
+        for (auto& branch : subrule.subrules())
+            if (danglingStart(branch)) nested = false;
+        if (nested) flattened.insert(flattened.end(), subrule.subrules().begin(), subrule.subrules().end());
+        else flattened.push_back(subrule);
+    }
+
+    // an empty chset matches the empty string, it is kept apart
+    Rules out;
+    int merged = -1;
+    for (auto& subrule : flattened)
+    {
+        bool chset = (subrule.discriminator() == Rule::Type::DChset) && not subrule.chset().ranges.empty();
+        if (chset && (merged >= 0)) out[merged] = Rule(out[merged].chset() | subrule.chset());
+        else
+        {
+            if (chset) merged = out.size();
+            out.push_back(subrule);
+        }
+    }
+
+    out = factored(out);
+    if (out.size() == 1) return out.front();
+    return Rule(Rule::Type::DOrSeq, out);
+}
+
+struct Normalization
+{
+    std::map<Rule, Rule> known;
+
+    Rule run(const Rule& rule)
+    {
+        auto it = known.find(rule);
+        if (it != known.end()) return it->second;
+        Rule out = normalized(rule);
+        known.insert({rule, out});
+        return out;
+    }
+
+    Rule normalized(const Rule& rule)
+    {
+        if (rule.subrules().empty()) return rule;
+        Rules subrules;
+        for (auto& subrule : rule.subrules()) subrules.push_back(run(subrule));
+        switch (rule.discriminator())
+        {
+            case Rule::Type::DSeq:
+                return sequence(subrules);
+            case Rule::Type::DOrSeq:
+                return alternation(subrules);
+            case Rule::Type::DRepeat:
+                if (danglingStart(subrules.front())) return Rule(Rule::Type::DEmpty);
+                return Rule(Rule::Type::DRepeat, subrules);
+            default:
+                return Rule(rule.discriminator(), subrules);
+        }
+    }
+};
+
+} //namespace
+
+Rule normalize(const Rule& rule)
+{
+    return Normalization().run(rule);
+}
+
+unsigned long nodeCount(const Rule& rule)
+{
+    unsigned long out = 1;
+    for (auto& subrule : rule.subrules()) out += nodeCount(subrule);
+    return out;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "RegexRule.hpp"
+
+// equivalent rule with nested sequences and alternations flattened,
+// chset alternatives merged, common leading subrules of alternatives
+// factored out and skipped empties removed; alternations with an empty
+// branch are left as they are, the automaton construction treats those
+// specially
+Rule normalize(const Rule& rule);
+// bumped whenever normalize returns other rules for the same input, since
+// grammar snapshots are keyed on the rules before normalization
+const unsigned NormalizationRevision = 1;
+// nodes of the rule counted as a tree, as the automaton construction sees it
+unsigned long nodeCount(const Rule& rule);
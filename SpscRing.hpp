@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// lock-free queue between one producer and one consumer thread over a fixed
+// power of two array of slots; the producer fills the slot at the back in
+// place and pushes it, the consumer reads the front in place and pops it,
+// so the slots keep their buffers while circulating. back() and front()
+// return nullptr when the ring is full or empty, waiting is up to the caller
+template <typename T>
+class SpscRing
+{
+    std::vector<T> slots;
+    std::size_t mask;
+    // head and tail on their own cache lines, each is written by one side
+    char padding0[64];
+    std::atomic<std::size_t> head;
+    char padding1[64];
+    std::atomic<std::size_t> tail;
+    char padding2[64];
+
+public:
+    explicit SpscRing(std::size_t capacity) : head(0), tail(0)
+    {
+        std::size_t size = 1;
+        while (size < capacity) size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    T* back()
+    {
+        std::size_t at = tail.load(std::memory_order_relaxed);
+        if (at - head.load(std::memory_order_acquire) == slots.size()) return nullptr;
+        return &slots[at & mask];
+    }
+    void push()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    T* front()
+    {
+        std::size_t at = head.load(std::memory_order_relaxed);
+        if (at == tail.load(std::memory_order_acquire)) return nullptr;
+        return &slots[at & mask];
+    }
+    void pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
@@ -1,209 +1,385 @@
 #include "StateMachine.hpp"
+#include "Nfa.hpp"
+#include "Dfa.hpp"
+#include "GrammarSnapshot.hpp"
+#include "RuleNormalization.hpp"
+#include "ThreadPool.hpp"
+#include "DirectLexer.hpp"
 #include <iostream>
-#include <cassert>
-#include <deque>
-#include <unordered_set>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <algorithm>
+
+unsigned StateMachine::maxDfaStates = 4096;
+std::size_t StateMachine::lazyDfaBudget = 1 << 20;
+std::ostream* StateMachine::report = std::getenv("CPPGM_AUTOMATA_REPORT") ? &std::cerr : nullptr;
+
+unsigned StateMachine::compileThreads = std::max(1u, std::thread::hardware_concurrency());
+std::function<void(const Rules&)> StateMachine::grammarObserver;
 
 namespace
 {
-typedef std::pair<uint64_t, uint64_t> CharRange;
-typedef std::set<CharRange> CharRanges;
-typedef std::pair<CharRanges, State*> Transition;
-typedef std::vector<Transition> Transitions;
-typedef std::vector<State*> AutomataEndings;
-typedef std::pair<State*, AutomataEndings> AutomataUnderConstruction;
-typedef std::vector<AutomataUnderConstruction> AutomatasUnderConstruction;
+
+std::string readDfaProfile()
+{
+    const char* path = std::getenv("CPPGM_DFA_PROFILE");
+    if (path == nullptr) return "";
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
 
 } //namespace
 
-struct State
+std::string StateMachine::dfaProfile = readDfaProfile();
+
+StateMachine::StateMachine()
+    : engine(Engine::Dfa), state(Dfa::Dead | Dfa::Stops), positions(0), matchedTag(NfaState::NoTag), live(false), directCoded(nullptr)
 {
-    Transitions transitions;
-};
+}
 
 namespace
 {
 
+typedef std::shared_future<CompiledGrammar> PendingGrammar;
 
-AutomataUnderConstruction createAutomata(const Rule& rule);
-AutomataUnderConstruction createOrAutomata(const Rule& rule)
+Nfa normalizedNfa(const Rules& definitions, std::ostream& report)
 {
-    assert(rule.discriminator == Rule::Type::DOrSeq);
-    AutomatasUnderConstruction automatas;
-    for (auto subrule : rule.subrules)
-    {
-        automatas.push_back(createAutomata(subrule));
-    }
-    State* start = new State();
-    AutomataEndings endings;
-    for (auto automata : automatas)
+    Rules normalized;
+    for (auto& definition : definitions) normalized.push_back(normalize(definition));
+    if (StateMachine::report)
     {
-        endings.insert(endings.end(), automata.second.begin(), automata.second.end());
-        start->transitions.push_back(Transition({}, automata.first));
-        if (automata.first == nullptr) endings.push_back(start);
+        unsigned long before = 0;
+        unsigned long after = 0;
+        for (unsigned i = 0; i < definitions.size(); ++i)
+        {
+            before += nodeCount(definitions[i]);
+            after += nodeCount(normalized[i]);
+        }
+        report << "rules: " << before << " -> " << after << " nodes" << std::endl;
     }
-    return AutomataUnderConstruction(start, endings);
+    return createNfa(normalized);
 }
-AutomataUnderConstruction createRepeatAutomata(const Rule& rule)
+
+CompiledGrammar compileNfa(const Nfa& nfa, std::ostream& report)
 {
-    assert(rule.discriminator == Rule::Type::DRepeat);
-    assert(rule.subrules.size() == 1);
-    AutomataUnderConstruction subautomata = createAutomata(rule.subrules.front());
-    if (subautomata.first == nullptr) return subautomata;
-    for (auto ending : subautomata.second)
+    CompiledGrammar out;
+    if (fitsBitParallel(nfa))
+    {
+        out.bitParallel = std::make_shared<BitParallel>(compileBitParallel(nfa));
+        report << "bit-parallel: " << out.bitParallel->follow.size() << " positions, "
+               << out.bitParallel->classes.count << " classes" << std::endl;
+        return out;
+    }
+    try
     {
-        Transition endingTransition = ending->transitions.front();
-        endingTransition.second = subautomata.first;
-        ending->transitions.push_back(endingTransition);
+        Dfa compiled = compileDfa(nfa, StateMachine::maxDfaStates);
+        Dfa minimized = minimizeDfa(compiled);
+        bool profiled = not StateMachine::dfaProfile.empty();
+        Dfa laidOut = layoutDfa(minimized, profiled ? profileDfa(minimized, StateMachine::dfaProfile)
+                                                    : std::vector<unsigned long>());
+        Dfa packed = packDfa(laidOut);
+        bool packing = packed.transitionBytes() < laidOut.transitionBytes();
+        out.dfa = std::make_shared<Dfa>(packing ? packed : laidOut);
+        report << "dfa: " << compiled.size() << " -> " << out.dfa->size() << " states, "
+               << compiled.classes.count << " -> " << out.dfa->classes.count << " classes, "
+               << (profiled ? "profiled" : "breadth-first") << " layout with rows of "
+               << laidOut.stride << " entries" << std::endl;
+        report << "dfa memory: " << classesBytes(out.dfa->classes) << " bytes of classes, "
+               << laidOut.transitionBytes() << " bytes of rows, " << packed.transitionBytes() << " packed with "
+               << 8 * packed.idWidth << "-bit ids, " << (packing ? "packed" : "kept plain") << std::endl;
     }
-    auto startState = new State();
-    startState->transitions.push_back(Transition({}, nullptr));
-    startState->transitions.push_back(Transition({}, subautomata.first));
-    subautomata.second.push_back(startState);
-    return AutomataUnderConstruction(startState, subautomata.second);
+    catch (DfaLimitExceeded&)
+    {
+        out.nfa = std::make_shared<Nfa>(nfa);
+        report << "lazy dfa: " << nfa.states.size() << " nfa states" << std::endl;
+    }
+    return out;
 }
-AutomataUnderConstruction createSeqAutomata(const Rule& rule)
+
+CompiledGrammar compileGrammar(const Rules& definitions, bool snapshot)
 {
-    assert(rule.discriminator == Rule::Type::DSeq);
-    AutomatasUnderConstruction automatas;
-    for (auto subrule : rule.subrules)
+    std::ostringstream report;
+    CompiledGrammar out;
+    if (snapshot && grammarSnapshotsEnabled())
     {
-        automatas.push_back(createAutomata(subrule));
+        uint64_t hash = grammarFingerprint(definitions);
+        std::string path = grammarSnapshotPath(hash);
+        if (not loadGrammarSnapshot(path, hash, definitions.size(), out))
+        {
+            out = compileNfa(normalizedNfa(definitions, report), report);
+            if (not out.nfa) saveGrammarSnapshot(path, hash, out);
+        }
     }
-    AutomataUnderConstruction prev = automatas.front();
-    for (auto automataIt = automatas.begin() + 1; automataIt != automatas.end(); ++automataIt)
+    else out = compileNfa(normalizedNfa(definitions, report), report);
+
+    static std::mutex reportMutex;
+    std::lock_guard<std::mutex> lock(reportMutex);
+    if (StateMachine::report) *StateMachine::report << report.str() << std::flush;
+    return out;
+}
+
+ThreadPool& compilePool()
+{
+    static ThreadPool pool(StateMachine::compileThreads);
+    return pool;
+}
+
+// rules are interned, so equal grammars share their compiled automaton
+// while their rules are alive; entries of freed rules are dropped when the
+// next grammar is added. Tokenizer grammars are compiled by the pool while
+// the caller goes on
+std::mutex compiledMutex;
+PendingGrammar compiled(const Rules& definitions, bool background)
+{
+    static std::map<WeakRules, PendingGrammar> grammars;
+    std::unique_lock<std::mutex> lock(compiledMutex);
+    auto it = grammars.find(definitions);
+    if (it != grammars.end()) return it->second;
+    for (it = grammars.begin(); it != grammars.end();)
+        it = it->first.expired() ? grammars.erase(it) : std::next(it);
+    if (background)
+        return grammars[definitions] = compilePool().submit([=]() { return compileGrammar(definitions, true); }).share();
+
+    std::promise<CompiledGrammar> result;
+    PendingGrammar pending = grammars[definitions] = result.get_future().share();
+    lock.unlock();
+    result.set_value(compileGrammar(definitions, false));
+    return pending;
+}
+
+} //namespace
+
+uint64_t grammarFingerprint(const Rules& definitions)
+{
+    uint64_t hash = StateMachine::maxDfaStates;
+    for (auto& definition : definitions) hash = hash * 0x100000001b3ull + fingerprint(definition);
+    return hash;
+}
+
+StateMachine::StateMachine(const Rule& rule)
+    : engine(Engine::Pending), state(Dfa::Dead), positions(0), matchedTag(NfaState::NoTag), live(false), directCoded(nullptr)
+{
+    pending = compiled(Rules({rule}), false);
+}
+
+StateMachine::StateMachine(const Rules& definitions)
+    : engine(Engine::Pending), state(Dfa::Dead), positions(0), matchedTag(NfaState::NoTag), live(false), directCoded(nullptr)
+{
+    if (grammarObserver) grammarObserver(definitions);
+    if (directCodedGrammarsRegistered()) directCoded = findDirectCodedGrammar(grammarFingerprint(definitions));
+    if (not directCoded)
     {
-        if (automataIt->first == nullptr) continue;
-        for (auto ending : prev.second)
-            ending->transitions.front().second = automataIt->first;
-        prev = *automataIt;
+        pending = compiled(definitions, true);
+        return;
     }
-    return AutomataUnderConstruction(automatas.front().first, prev.second);
+    engine = Engine::DirectCoded;
+    state = directCoded->start;
+    if (std::getenv("CPPGM_DIRECT_CHECK") == nullptr) return;
+    reference = std::make_shared<StateMachine>();
+    reference->engine = Engine::Pending;
+    reference->pending = compiled(definitions, true);
 }
-AutomataUnderConstruction createChsetAutomata(const Rule& rule)
+
+void StateMachine::await()
 {
-    assert(rule.discriminator == Rule::Type::DChset);
-    assert(rule.subrules.empty());
-    State* start = new State();
-    start->transitions.push_back({rule.chset.ranges, nullptr});
-    return AutomataUnderConstruction(start, {start});
+    const CompiledGrammar& grammar = pending.get();
+    if (grammar.nfa)
+    {
+        engine = Engine::LazyDfa;
+        lazyDfa = std::make_shared<LazyDfa>(*grammar.nfa, lazyDfaBudget);
+    }
+    else engine = grammar.dfa ? Engine::Dfa : Engine::BitParallel;
+    dfa = grammar.dfa;
+    bitParallel = grammar.bitParallel;
+    pending = PendingGrammar();
+    reset();
 }
-AutomataUnderConstruction createEmptyAutomata()
+
+bool StateMachine::processDirectCoded(uint64_t c)
 {
-    return AutomataUnderConstruction(nullptr, {});
+    bool matched = false;
+    if (state != Dfa::Dead)
+    {
+        state = directCoded->step(state, c);
+        matched = directCoded->accepting[state] != NfaState::NoTag;
+    }
+    if (reference && ((reference->process(c) != matched)
+                      || (reference->matchedDefinition() != directCoded->accepting[state])
+                      || (reference->foreverUnmatched() != ((state == Dfa::Dead) || not directCoded->live[state]))))
+        throw std::logic_error("direct-coded grammar differs from its rules");
+    return matched;
 }
-AutomataUnderConstruction createAutomata(const Rule& rule)
+
+bool StateMachine::process(uint64_t c)
 {
-    switch (rule.discriminator)
+    if (engine == Engine::Pending) await();
+    if (engine == Engine::DirectCoded) return processDirectCoded(c);
+    if (engine == Engine::BitParallel)
+    {
+        if (not live) return false;
+        BitParallel::Positions matched = positions & bitParallel->matching(c);
+        positions = bitParallel->next(matched);
+        live = (matched & bitParallel->live) != 0;
+        matchedTag = bitParallel->acceptedTag(matched);
+        return matchedTag != NfaState::NoTag;
+    }
+    if (engine == Engine::LazyDfa)
     {
-        case Rule::Type::DChset:
-            return createChsetAutomata(rule);
-        case Rule::Type::DSeq:
-            return createSeqAutomata(rule);
-        case Rule::Type::DRepeat:
-            return createRepeatAutomata(rule);
-        case Rule::Type::DOrSeq:
-            return createOrAutomata(rule);
-        case Rule::Type::DEmpty:
-            return createEmptyAutomata();
-        default:
-            return AutomataUnderConstruction(nullptr, {});
+        if (not node->live) return false;
+        node = lazyDfa->next(node, c);
+        return node->accepting != NfaState::NoTag;
     }
+    if (state & Dfa::Stops) return false;
+    state = dfa->entry(state & Dfa::TargetMask, c);
+    return state & Dfa::Accepts;
 }
 
-} //namespace
+bool StateMachine::foreverUnmatched()
+{
+    if (engine == Engine::Pending) await();
+    if (engine == Engine::BitParallel) return not live;
+    if (engine == Engine::LazyDfa) return not node->live;
+    if (engine == Engine::DirectCoded) return (state == Dfa::Dead) || not directCoded->live[state];
+    return state & Dfa::Stops;
+}
 
-namespace
+int StateMachine::matchedDefinition()
 {
-typedef std::set<State*> StateSet;
+    if (engine == Engine::Pending) await();
+    if (engine == Engine::BitParallel) return matchedTag;
+    if (engine == Engine::LazyDfa) return node->accepting;
+    if (engine == Engine::DirectCoded) return directCoded->accepting[state];
+    return dfa ? dfa->accepting[state & Dfa::TargetMask] : NfaState::NoTag;
+}
 
-bool matches(const CharRanges& ranges, uint64_t c)
+void StateMachine::reset()
 {
-    for (auto range : ranges)
+    if (engine == Engine::Pending) return;
+    if (engine == Engine::BitParallel)
+    {
+        positions = bitParallel->start;
+        live = bitParallel->startLive;
+        matchedTag = NfaState::NoTag;
+    }
+    else if (engine == Engine::LazyDfa) node = lazyDfa->start();
+    else if (engine == Engine::DirectCoded)
     {
-        if ((c >= range.first) && (c <= range.second))
-            return true;
+        state = directCoded->start;
+        if (reference) reference->reset();
     }
-    return false;
+    else if (dfa) state = dfa->entryOf(dfa->start);
 }
 
-bool processEpsilonTransitions(StateSet& states)
+CompiledRule::CompiledRule(const Rule& rule)
 {
-    StateSet nextStates;
-    bool matched = false;
-    std::deque<State*> stateQueue(states.begin(), states.end());
-    while (not stateQueue.empty())
+    StateMachine machine(rule);
+    machine.await();
+    dfa = machine.dfa;
+    bitParallel = machine.bitParallel;
+    if (machine.engine != StateMachine::Engine::LazyDfa) return;
+    lazyDfa = machine.lazyDfa;
+    lazyDfaMutex = std::make_shared<std::mutex>();
+}
+
+template <typename Char>
+std::size_t CompiledRule::longestPrefix(const Char* data, std::size_t length) const
+{
+    std::size_t out = 0;
+    if (bitParallel)
     {
-        auto curr = stateQueue.front();
-        stateQueue.pop_front();
-        for (auto transition : curr->transitions)
+        BitParallel::Positions positions = bitParallel->start;
+        bool live = bitParallel->startLive;
+        for (std::size_t i = 0; live && (i < length); ++i)
         {
-            if (transition.first.empty())
-            {
-                if (transition.second == nullptr) matched = true;
-                else if (nextStates.count(transition.second) == 0)
-                    stateQueue.push_back(transition.second);
-            }
+            BitParallel::Positions matched = positions & bitParallel->matching(uint64_t(data[i]));
+            positions = bitParallel->next(matched);
+            live = (matched & bitParallel->live) != 0;
+            if (bitParallel->acceptedTag(matched) != NfaState::NoTag) out = i + 1;
         }
-        nextStates.insert(curr);
     }
-    states = nextStates;
-    return matched;
+    else if (dfa)
+    {
+        unsigned entry = dfa->entryOf(dfa->start);
+        for (std::size_t i = 0; not (entry & Dfa::Stops) && (i < length); ++i)
+        {
+            entry = dfa->entry(entry & Dfa::TargetMask, uint64_t(data[i]));
+            if (entry & Dfa::Accepts) out = i + 1;
+        }
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(*lazyDfaMutex);
+        LazyDfa::NodePtr node = lazyDfa->start();
+        for (std::size_t i = 0; node->live && (i < length); ++i)
+        {
+            node = lazyDfa->next(node, uint64_t(data[i]));
+            if (node->accepting != NfaState::NoTag) out = i + 1;
+        }
+    }
+    return out;
 }
 
-bool process(StateSet& states, uint64_t c)
+template <typename Char>
+CompiledRule::Match CompiledRule::leftmostLongest(const Char* data, std::size_t length) const
 {
-    StateSet nextStates;
-    bool matched = false;
-    for (auto state : states)
+    for (std::size_t position = 0; position < length; ++position)
     {
-        for (auto transition : state->transitions)
-        {
-            if (matches(transition.first, c))
-            {
-                if (transition.second == nullptr) matched = true;
-                else nextStates.insert(transition.second);
-            }
-        }
+        std::size_t matched = longestPrefix(data + position, length - position);
+        if (matched > 0) return {position, matched};
     }
-    states = nextStates;
-    matched |= processEpsilonTransitions(states);
-    return matched;
+    return {length, 0};
 }
 
-} //namespace
+bool CompiledRule::fullMatch(const char* data, std::size_t length) const
+{
+    return (length > 0) && (longestPrefix(data, length) == length);
+}
 
-StateMachine::StateMachine()
+bool CompiledRule::fullMatch(const wchar_t* data, std::size_t length) const
 {
+    return (length > 0) && (longestPrefix(data, length) == length);
 }
 
-StateMachine::StateMachine(const Rule& rule)
+bool CompiledRule::fullMatch(const std::string& str) const
 {
-    states.insert(createAutomata(rule).first);
-    processEpsilonTransitions(states);
+    return fullMatch(str.data(), str.size());
 }
 
-bool StateMachine::process(uint64_t c)
+bool CompiledRule::fullMatch(const std::wstring& str) const
 {
-    return ::process(states, c);
+    return fullMatch(str.data(), str.size());
 }
 
-bool StateMachine::foreverUnmatched()
+std::size_t CompiledRule::longestPrefixMatch(const char* data, std::size_t length) const
+{
+    return longestPrefix(data, length);
+}
+
+std::size_t CompiledRule::longestPrefixMatch(const wchar_t* data, std::size_t length) const
+{
+    return longestPrefix(data, length);
+}
+
+CompiledRule::Match CompiledRule::find(const char* data, std::size_t length) const
+{
+    return leftmostLongest(data, length);
+}
+
+CompiledRule::Match CompiledRule::find(const wchar_t* data, std::size_t length) const
 {
-    return states.empty();
+    return leftmostLongest(data, length);
 }
 
 bool matches(const Rule& rule, std::wstring str)
 {
-    StateMachine machine(rule);
-    bool ret = false;
-    for (auto c : str)
-        ret = machine.process(c);
-    return ret;
+    return CompiledRule(rule).fullMatch(str);
 }
 
 bool matches(const Rule& rule, std::string str)
 {
-    return matches(rule, std::wstring(str.begin(), str.end()));
+    return CompiledRule(rule).fullMatch(str);
 }
-
@@ -1,18 +1,121 @@
 #pragma once
 
 #include "RegexRule.hpp"
+#include "LazyDfa.hpp"
+#include "BitParallel.hpp"
+#include "GrammarSnapshot.hpp"
+#include <memory>
+#include <ostream>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <string>
 
-struct State;
+struct Dfa;
+struct DirectCodedGrammar;
+class CompiledRule;
 class StateMachine
 {
-    std::set<State*> states;
+    enum class Engine
+    {
+        Pending,
+        Dfa,
+        LazyDfa,
+        BitParallel,
+        DirectCoded
+    };
+    Engine engine;
+    std::shared_ptr<const Dfa> dfa;
+    // the flagged entry of the current state with a dfa, the state otherwise
+    unsigned state;
+    std::shared_ptr<LazyDfa> lazyDfa;
+    LazyDfa::NodePtr node;
+    std::shared_ptr<const BitParallel> bitParallel;
+    BitParallel::Positions positions;
+    int matchedTag;
+    bool live;
+    std::shared_future<CompiledGrammar> pending;
+    const DirectCodedGrammar* directCoded;
+    // the interpreted automaton run alongside a direct-coded one in checks
+    std::shared_ptr<StateMachine> reference;
+
+    void await();
+    bool processDirectCoded(uint64_t c);
+
+    friend class CompiledRule;
 public:
+    // rules are normalized before compiling and automata are shared by all
+    // machines built from the same rules;
+    // rules with at most 64 positions are matched bit-parallel, the others
+    // are compiled to a dfa; rules whose dfa would need more than maxDfaStates
+    // states are matched with a lazily built dfa, which keeps at most
+    // lazyDfaBudget bytes cached
+    static unsigned maxDfaStates;
+    static std::size_t lazyDfaBudget;
+    // when set, every compiled rule reports the size of its automaton there;
+    // defaults to std::cerr if CPPGM_AUTOMATA_REPORT is set in the environment
+    static std::ostream* report;
+    // workers compiling tokenizer grammars, read when the first one is built
+    static unsigned compileThreads;
+    // sample input whose state visits order the states of compiled dfas,
+    // read from the file named by CPPGM_DFA_PROFILE; breadth-first if empty
+    static std::string dfaProfile;
+    // called with the definitions of every tokenizer grammar built
+    static std::function<void(const Rules&)> grammarObserver;
+
     StateMachine();
     StateMachine(const Rule& rule);
+    // one automaton for all definitions, a match reports the index of the
+    // last definition accepting the input processed so far; it is compiled
+    // in the background until the first character arrives and kept as a
+    // grammar snapshot when those are enabled; a direct-coded grammar linked
+    // in replaces it, with CPPGM_DIRECT_CHECK set both run and must agree
+    StateMachine(const Rules& definitions);
     bool process(uint64_t c);
     bool foreverUnmatched();
+    int matchedDefinition();
+    void reset();
 };
 
+// immutable automaton of a single rule, shareable between threads; chars
+// are widened like in matches(), empty input never matches
+class CompiledRule
+{
+public:
+    struct Match
+    {
+        std::size_t position;
+        std::size_t length;
+    };
+
+    CompiledRule(const Rule& rule);
+
+    bool fullMatch(const char* data, std::size_t length) const;
+    bool fullMatch(const wchar_t* data, std::size_t length) const;
+    bool fullMatch(const std::string& str) const;
+    bool fullMatch(const std::wstring& str) const;
+    // length of the longest matching prefix, 0 if there is none
+    std::size_t longestPrefixMatch(const char* data, std::size_t length) const;
+    std::size_t longestPrefixMatch(const wchar_t* data, std::size_t length) const;
+    // leftmost longest match, its length is 0 if there is none
+    Match find(const char* data, std::size_t length) const;
+    Match find(const wchar_t* data, std::size_t length) const;
+
+private:
+    std::shared_ptr<const Dfa> dfa;
+    std::shared_ptr<const BitParallel> bitParallel;
+    // a lazy dfa grows while matching, so its use is serialized
+    std::shared_ptr<LazyDfa> lazyDfa;
+    std::shared_ptr<std::mutex> lazyDfaMutex;
+
+    template <typename Char>
+    std::size_t longestPrefix(const Char* data, std::size_t length) const;
+    template <typename Char>
+    Match leftmostLongest(const Char* data, std::size_t length) const;
+};
+
+// identifies the compiled automaton of the definitions
+uint64_t grammarFingerprint(const Rules& definitions);
+
 bool matches(const Rule& rule, std::wstring str);
 bool matches(const Rule& rule, std::string str);
-
@@ -0,0 +1,313 @@
+#pragma once
+
+#include "RegexRule.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// compile-time variant of the rule dsl: a static rule is an empty object
+// whose type spells the expression, combined with the same >>, |, *, + and !
+// operators; chsets are lists of ranges given as template arguments
+// (staticRange<'a', 'z'>() | staticChars<'_'>()), merged by | like chsets.
+// The position automaton of a rule is computed by the compiler into
+// constexpr tables, so matching needs no construction at startup and the
+// character tests inline; rule() gives the equivalent runtime Rule.
+// Like in Rule, + repeats zero or more times; ! is a plain optional and a
+// rule may contain at most 64 chset occurrences
+
+template <typename Expr>
+struct StaticRule;
+
+constexpr uint64_t staticBit(unsigned position)
+{
+    return (position < 64) ? (uint64_t(1) << position) : 0;
+}
+
+template <uint64_t Low, uint64_t High>
+struct StaticRange
+{
+    static_assert(Low <= High, "empty static range");
+
+    static constexpr bool contains(uint64_t c) { return (c >= Low) && (c <= High); }
+};
+
+template <typename... Ranges>
+struct StaticRanges
+{
+    static constexpr bool contains(uint64_t) { return false; }
+    static void append(CharRanges&) {}
+};
+
+template <uint64_t Low, uint64_t High, typename... Ranges>
+struct StaticRanges<StaticRange<Low, High>, Ranges...>
+{
+    static constexpr bool contains(uint64_t c)
+    {
+        return StaticRange<Low, High>::contains(c) || StaticRanges<Ranges...>::contains(c);
+    }
+    static void append(CharRanges& out)
+    {
+        out.push_back({Low, High});
+        StaticRanges<Ranges...>::append(out);
+    }
+};
+
+// every expression numbers its chset occurrences (positions) from offset on
+// and describes its position automaton: which positions may match first,
+// which may match last and which may follow a given one
+template <typename... Ranges>
+struct StaticChset : StaticRule<StaticChset<Ranges...>>
+{
+    static_assert(sizeof...(Ranges) > 0, "empty static chset");
+
+    static constexpr unsigned positions = 1;
+    static constexpr bool nullable = false;
+    static constexpr uint64_t first(unsigned offset) { return staticBit(offset); }
+    static constexpr uint64_t last(unsigned offset) { return staticBit(offset); }
+    static constexpr uint64_t follow(unsigned, unsigned) { return 0; }
+    static constexpr uint64_t matching(unsigned offset, uint64_t c)
+    {
+        return StaticRanges<Ranges...>::contains(c) ? staticBit(offset) : 0;
+    }
+    static Rule rule()
+    {
+        CharRanges ranges;
+        StaticRanges<Ranges...>::append(ranges);
+        return Rule(Chset(ranges));
+    }
+};
+
+template <typename Left, typename Right>
+struct StaticSeq : StaticRule<StaticSeq<Left, Right>>
+{
+    static constexpr unsigned positions = Left::positions + Right::positions;
+    static constexpr bool nullable = Left::nullable && Right::nullable;
+    static constexpr uint64_t first(unsigned offset)
+    {
+        return Left::first(offset) | (Left::nullable ? Right::first(offset + Left::positions) : 0);
+    }
+    static constexpr uint64_t last(unsigned offset)
+    {
+        return Right::last(offset + Left::positions) | (Right::nullable ? Left::last(offset) : 0);
+    }
+    static constexpr uint64_t follow(unsigned offset, unsigned position)
+    {
+        return (position < offset + Left::positions)
+            ? (Left::follow(offset, position)
+               | ((Left::last(offset) & staticBit(position)) ? Right::first(offset + Left::positions) : 0))
+            : Right::follow(offset + Left::positions, position);
+    }
+    static constexpr uint64_t matching(unsigned offset, uint64_t c)
+    {
+        return Left::matching(offset, c) | Right::matching(offset + Left::positions, c);
+    }
+    static Rule rule() { return Left::rule() >> Right::rule(); }
+};
+
+template <typename Left, typename Right>
+struct StaticOr : StaticRule<StaticOr<Left, Right>>
+{
+    static constexpr unsigned positions = Left::positions + Right::positions;
+    static constexpr bool nullable = Left::nullable || Right::nullable;
+    static constexpr uint64_t first(unsigned offset)
+    {
+        return Left::first(offset) | Right::first(offset + Left::positions);
+    }
+    static constexpr uint64_t last(unsigned offset)
+    {
+        return Left::last(offset) | Right::last(offset + Left::positions);
+    }
+    static constexpr uint64_t follow(unsigned offset, unsigned position)
+    {
+        return (position < offset + Left::positions)
+            ? Left::follow(offset, position)
+            : Right::follow(offset + Left::positions, position);
+    }
+    static constexpr uint64_t matching(unsigned offset, uint64_t c)
+    {
+        return Left::matching(offset, c) | Right::matching(offset + Left::positions, c);
+    }
+    static Rule rule() { return Left::rule() | Right::rule(); }
+};
+
+template <typename Sub>
+struct StaticRepeat : StaticRule<StaticRepeat<Sub>>
+{
+    static constexpr unsigned positions = Sub::positions;
+    static constexpr bool nullable = true;
+    static constexpr uint64_t first(unsigned offset) { return Sub::first(offset); }
+    static constexpr uint64_t last(unsigned offset) { return Sub::last(offset); }
+    static constexpr uint64_t follow(unsigned offset, unsigned position)
+    {
+        return Sub::follow(offset, position)
+            | ((Sub::last(offset) & staticBit(position)) ? Sub::first(offset) : 0);
+    }
+    static constexpr uint64_t matching(unsigned offset, uint64_t c) { return Sub::matching(offset, c); }
+    static Rule rule() { return *Sub::rule(); }
+};
+
+template <typename Sub>
+struct StaticOptional : StaticRule<StaticOptional<Sub>>
+{
+    static constexpr unsigned positions = Sub::positions;
+    static constexpr bool nullable = true;
+    static constexpr uint64_t first(unsigned offset) { return Sub::first(offset); }
+    static constexpr uint64_t last(unsigned offset) { return Sub::last(offset); }
+    static constexpr uint64_t follow(unsigned offset, unsigned position) { return Sub::follow(offset, position); }
+    static constexpr uint64_t matching(unsigned offset, uint64_t c) { return Sub::matching(offset, c); }
+    static Rule rule() { return !Sub::rule(); }
+};
+
+template <unsigned... Indices>
+struct StaticIndices {};
+
+template <unsigned N, unsigned... Indices>
+struct MakeStaticIndices : MakeStaticIndices<N - 1, N - 1, Indices...> {};
+
+template <unsigned... Indices>
+struct MakeStaticIndices<0, Indices...>
+{
+    typedef StaticIndices<Indices...> type;
+};
+
+// constexpr tables of the position automaton, a state is the mask of
+// positions which may match the next character
+template <typename Expr,
+          typename Positions = typename MakeStaticIndices<Expr::positions>::type,
+          typename Bytes = typename MakeStaticIndices<256>::type>
+struct StaticAutomaton;
+
+template <typename Expr, unsigned... Positions, unsigned... Bytes>
+struct StaticAutomaton<Expr, StaticIndices<Positions...>, StaticIndices<Bytes...>>
+{
+    static_assert(Expr::positions <= 64, "static rules are limited to 64 chset occurrences");
+
+    static constexpr uint64_t start = Expr::first(0);
+    static constexpr uint64_t accepting = Expr::last(0);
+    static constexpr uint64_t follow[Expr::positions + 1] = {Expr::follow(0, Positions)..., 0};
+    static constexpr uint64_t byteMatches[256] = {Expr::matching(0, Bytes)...};
+
+    static uint64_t matching(uint64_t c)
+    {
+        if (c < 256) return byteMatches[c];
+        return Expr::matching(0, c);
+    }
+    static uint64_t next(uint64_t matched)
+    {
+        uint64_t out = 0;
+        for (; matched != 0; matched &= matched - 1)
+            out |= follow[__builtin_ctzll(matched)];
+        return out;
+    }
+    template <typename Char>
+    static std::size_t longestPrefix(const Char* data, std::size_t length)
+    {
+        std::size_t out = 0;
+        uint64_t positions = start;
+        for (std::size_t i = 0; (positions != 0) && (i < length); ++i)
+        {
+            uint64_t matched = positions & matching(uint64_t(data[i]));
+            if (matched & accepting) out = i + 1;
+            positions = next(matched);
+        }
+        return out;
+    }
+};
+
+template <typename Expr, unsigned... Positions, unsigned... Bytes>
+constexpr uint64_t StaticAutomaton<Expr, StaticIndices<Positions...>, StaticIndices<Bytes...>>::follow[];
+template <typename Expr, unsigned... Positions, unsigned... Bytes>
+constexpr uint64_t StaticAutomaton<Expr, StaticIndices<Positions...>, StaticIndices<Bytes...>>::byteMatches[];
+
+// matching mirrors CompiledRule: chars are widened the same way and
+// empty input never matches
+template <typename Expr>
+struct StaticRule
+{
+    bool fullMatch(const char* data, std::size_t length) const
+    {
+        return (length > 0) && (StaticAutomaton<Expr>::longestPrefix(data, length) == length);
+    }
+    bool fullMatch(const wchar_t* data, std::size_t length) const
+    {
+        return (length > 0) && (StaticAutomaton<Expr>::longestPrefix(data, length) == length);
+    }
+    bool fullMatch(const std::string& str) const { return fullMatch(str.data(), str.size()); }
+    bool fullMatch(const std::wstring& str) const { return fullMatch(str.data(), str.size()); }
+    // length of the longest matching prefix, 0 if there is none
+    std::size_t longestPrefixMatch(const char* data, std::size_t length) const
+    {
+        return StaticAutomaton<Expr>::longestPrefix(data, length);
+    }
+    std::size_t longestPrefixMatch(const wchar_t* data, std::size_t length) const
+    {
+        return StaticAutomaton<Expr>::longestPrefix(data, length);
+    }
+};
+
+template <uint64_t Low, uint64_t High>
+constexpr StaticChset<StaticRange<Low, High>> staticRange()
+{
+    return StaticChset<StaticRange<Low, High>>();
+}
+
+template <uint64_t... Chars>
+constexpr StaticChset<StaticRange<Chars, Chars>...> staticChars()
+{
+    return StaticChset<StaticRange<Chars, Chars>...>();
+}
+
+template <uint64_t Char, uint64_t... Chars>
+struct StaticString
+{
+    typedef StaticSeq<StaticChset<StaticRange<Char, Char>>, typename StaticString<Chars...>::type> type;
+};
+
+template <uint64_t Char>
+struct StaticString<Char>
+{
+    typedef StaticChset<StaticRange<Char, Char>> type;
+};
+
+// sequence of the given characters, like Rule(L"...")
+template <uint64_t... Chars>
+constexpr typename StaticString<Chars...>::type staticString()
+{
+    return typename StaticString<Chars...>::type();
+}
+
+template <typename Left, typename Right>
+constexpr StaticSeq<Left, Right> operator>>(const StaticRule<Left>&, const StaticRule<Right>&)
+{
+    return StaticSeq<Left, Right>();
+}
+
+template <typename Left, typename Right>
+constexpr StaticOr<Left, Right> operator|(const StaticRule<Left>&, const StaticRule<Right>&)
+{
+    return StaticOr<Left, Right>();
+}
+
+template <typename... Left, typename... Right>
+constexpr StaticChset<Left..., Right...> operator|(const StaticChset<Left...>&, const StaticChset<Right...>&)
+{
+    return StaticChset<Left..., Right...>();
+}
+
+template <typename Sub>
+constexpr StaticRepeat<Sub> operator*(const StaticRule<Sub>&)
+{
+    return StaticRepeat<Sub>();
+}
+
+template <typename Sub>
+constexpr StaticRepeat<Sub> operator+(const StaticRule<Sub>&)
+{
+    return StaticRepeat<Sub>();
+}
+
+template <typename Sub>
+constexpr StaticOptional<Sub> operator!(const StaticRule<Sub>&)
+{
+    return StaticOptional<Sub>();
+}
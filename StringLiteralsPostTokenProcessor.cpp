@@ -1,6 +1,7 @@
 #include "StringLiteralsPostTokenProcessor.hpp"
 #include "Lexer.hpp"
 #include "RegexRule.hpp"
+#include "StaticRule.hpp"
 #include "Helpers.hpp"
 #include "StandardData.hpp"
 
@@ -24,8 +25,8 @@ std::string toUtf16(uint32_t arg)
 }
 
 enum class Token { Esc, Char, EoS, Utf8Char };
-typedef std::function<void (uint64_t, std::wstring)> Handler;
-typedef std::function<void(uint64_t, std::wstring, Handler)> InitialLinker;
+typedef std::function<void (uint64_t, TokenText)> Handler;
+typedef std::function<void(uint64_t, TokenText, Handler)> InitialLinker;
 typedef std::vector<std::pair<Token, Rule>> Definitions;
 typedef TokenizerChain<TokenizerChainLinkType<uint64_t, uint64_t, Token>> Tokenizer;
 const uint64_t EndOfString = -1;
@@ -38,16 +39,21 @@ void parseString(const std::string& arg, TokenHandler tokenHandler, Definitions
     defs.push_back({Token::Char, anychar});
     defs.push_back({Token::EoS, end});
 
-    InitialLinker initialLinker = [](uint64_t c, std::wstring text, Handler h) { h(c, text); };
+    InitialLinker initialLinker = [](uint64_t c, TokenText text, Handler h) { h(c, text); };
     auto tokenizer = Tokenizer(tokenHandler, std::pair<InitialLinker, Definitions>({initialLinker, defs}));
-    for (auto c : arg) tokenizer.handler(wcharToUint64(c), {wchar_t(c)});
-    tokenizer.handler(EndOfString, {wchar_t(EndOfString)});
+    for (auto c : arg)
+    {
+        wchar_t text = wchar_t(c);
+        tokenizer.handler(wcharToUint64(c), TokenText(&text, 1));
+    }
+    wchar_t endText = wchar_t(EndOfString);
+    tokenizer.handler(EndOfString, TokenText(&endText, 1));
 }
 
 std::string convertEscapeSeqs(const std::string arg)
 {
     std::string out = "";
-    auto tokenHandler = [&](Token token, std::wstring val)
+    auto tokenHandler = [&](Token token, TokenText val)
         {
             std::string temp(val.begin(), val.end());
             if (token == Token::Esc) temp = convertEscapeSeq(temp, StringCoding::Utf8);
@@ -75,7 +81,7 @@ std::vector<char> encodeString(
     const std::string arg, StringCoding coding)
 {
     std::vector<char> out;
-    auto tokenHandler = [&](Token token, std::wstring val)
+    auto tokenHandler = [&](Token token, TokenText val)
         {
             std::string temp(val.begin(), val.end());
             if (token == Token::Utf8Char)
@@ -220,6 +226,8 @@ void StringLiteralsPostTokenProcessor::clear()
 
 std::string convertEscapeSeq(std::string arg, StringCoding coding)
 {
+    constexpr auto hexDigits = +(staticRange<'0', '9'>() | staticRange<'a', 'f'>() | staticRange<'A', 'F'>());
+    constexpr auto octDigits = +staticRange<'0', '7'>();
     if (arg.empty()) return "";
     if (arg[0] != '\\') return arg;
     if (arg.size() == 1) return "";
@@ -237,7 +245,7 @@ std::string convertEscapeSeq(std::string arg, StringCoding coding)
         if ((arg[1] >= '0') && (arg[1] <= '7')) return toStr(int(arg[1] - '0'));
         return "";
     }
-    else if ((arg[1] == 'x') && (arg.size() < 10) && (matches(+chset(L"0-9a-fA-F"), arg.substr(2))))
+    else if ((arg[1] == 'x') && (arg.size() < 10) && hexDigits.fullMatch(arg.data() + 2, arg.size() - 2))
     {
         uint32_t aux = 0;
         for (auto c : arg.substr(2)) aux = (aux << 4) + HexCharToValue(c);
@@ -245,7 +253,7 @@ std::string convertEscapeSeq(std::string arg, StringCoding coding)
         else if (coding == StringCoding::Utf16) return toUtf16(aux);
         else if (coding == StringCoding::Utf32) return std::string((char*)&aux, (char*)&aux + sizeof(aux));
     }
-    else if ((arg.size() < 17) && matches(+chset(L"0-7"), arg.substr(1)))
+    else if ((arg.size() < 17) && octDigits.fullMatch(arg.data() + 1, arg.size() - 1))
     {
         uint32_t aux = 0;
         for (auto c : arg.substr(1)) aux = (aux << 3) + int(c - '0');
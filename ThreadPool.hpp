@@ -0,0 +1,41 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// fixed set of worker threads taking submitted tasks in submission order;
+// the destructor finishes queued tasks before joining
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threads);
+    ~ThreadPool();
+
+    template <typename Task>
+    auto submit(Task task) -> std::future<decltype(task())>
+    {
+        typedef decltype(task()) Result;
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(task);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push([packaged]() { (*packaged)(); });
+        }
+        wakeup.notify_one();
+        return packaged->get_future();
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping;
+
+    void work();
+};
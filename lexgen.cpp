@@ -0,0 +1,45 @@
+#include <iostream>
+
+using namespace std;
+
+#include "DebugPPTokenStream.h"
+#include "PPTokenizer.hpp"
+#include "StateMachine.hpp"
+#include "RuleNormalization.hpp"
+#include "DirectLexer.hpp"
+
+// prints the direct-coded scanners of all tokenizer grammars of PPTokenizer
+int main()
+{
+	try
+	{
+		vector<Rules> grammars;
+		StateMachine::grammarObserver = [&](const Rules& definitions) { grammars.push_back(definitions); };
+		PPTokenizer tokenizer(std::make_shared<DebugPPTokenStream>());
+
+		cout << "// generated by lexgen from the PPTokenizer grammars, do not edit\n\n";
+		cout << "#include \"DirectLexer.hpp\"\n\n";
+		cout << "namespace\n{\n\n";
+		for (unsigned i = 0; i < grammars.size(); ++i)
+		{
+			Rules normalized;
+			for (auto& definition : grammars[i]) normalized.push_back(normalize(definition));
+			try
+			{
+				Dfa dfa = minimizeDfa(compileDfa(createNfa(normalized), StateMachine::maxDfaStates));
+				dfa = layoutDfa(dfa, StateMachine::dfaProfile.empty() ? vector<unsigned long>() : profileDfa(dfa, StateMachine::dfaProfile));
+				emitDirectCodedGrammar(cout, dfa, grammarFingerprint(grammars[i]), "grammar" + to_string(i));
+			}
+			catch (DfaLimitExceeded&)
+			{
+				cout << "// grammar " << i << " exceeds the dfa state limit\n\n";
+			}
+		}
+		cout << "} //namespace\n";
+	}
+	catch (exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+}
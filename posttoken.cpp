@@ -31,11 +31,7 @@ int main()
 
 		string input = oss.str();
 
-		for (char c : input)
-		{
-			unsigned char code_unit = c;
-			tokenizer.process(code_unit);
-		}
+		tokenizer.processBlock(reinterpret_cast<const unsigned char*>(input.data()), input.size());
 
 		tokenizer.process(EndOfFile);
 	}
@@ -22,11 +22,7 @@ int main()
 
 		PPTokenizer tokenizer(output);
 
-		for (char c : input)
-		{
-			unsigned char code_unit = c;
-			tokenizer.process(code_unit);
-		}
+		tokenizer.processBlock(reinterpret_cast<const unsigned char*>(input.data()), input.size());
 
 		tokenizer.process(EndOfFile);
 	}
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
+
+using namespace std;
+
+#include "IPPTokenStream.h"
+#include "StandardData.hpp"
+#include "PPTokenizer.hpp"
+
+// counts tokens instead of printing them
+struct CountingPPTokenStream : IPPTokenStream
+{
+	unsigned long tokens = 0;
+
+	void emit_whitespace_sequence() { ++tokens; }
+	void emit_new_line() { ++tokens; }
+	void emit_header_name(const string&) { ++tokens; }
+	void emit_identifier(const string&) { ++tokens; }
+	void emit_pp_number(const string&) { ++tokens; }
+	void emit_character_literal(const string&) { ++tokens; }
+	void emit_user_defined_character_literal(const string&) { ++tokens; }
+	void emit_string_literal(const string&) { ++tokens; }
+	void emit_user_defined_string_literal(const string&) { ++tokens; }
+	void emit_preprocessing_op_or_punc(const string&) { ++tokens; }
+	void emit_non_whitespace_char(const string&) { ++tokens; }
+	void emit_eof() { ++tokens; }
+};
+
+const char* sample =
+	"#include <vector>\n"
+	"/* block comment spanning\n   two lines */\n"
+	"template <typename T> struct Node { T value; Node* next = nullptr; };\n"
+	"int f(int a, double b) { return a * 0x1F + int(b * 1.5e-3) >> 2; } // tail\n"
+	"const char* s = \"escaped \\\" quote\", *r = R\"x(raw )\" string)x\";\n"
+	"wchar_t w = L'\\u00e9'; auto u = u8\"\\U0001F600 z\"_suffix; x <<= y ?\?= z;\n"
+	"\\u00e9dentifier = a->*b ... c %:%: d <::> e;\n";
+
+// tokenizes inputs of doubling size; the time per byte stays flat when
+// tokenizing scales linearly with the input. Grammars are compiled before
+// timing starts
+int main(int argc, char** argv)
+{
+	try
+	{
+		size_t base = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 128;
+		string unit(sample);
+		// compiled grammars stay cached while a tokenizer using them lives,
+		// so only this one compiles them; tokenizing the sample once also
+		// brings their tables into the caches
+		PPTokenizer warm(make_shared<CountingPPTokenStream>());
+		warm.processBlock(reinterpret_cast<const unsigned char*>(unit.data()), unit.size());
+		warm.process(EndOfFile);
+		cout << "bytes\ttokens\tseconds\tns/byte\tMB/s" << endl;
+		for (size_t kb = base; kb <= base * 8; kb *= 2)
+		{
+			string input;
+			while (input.size() < kb * 1024) input += unit;
+
+			auto output = make_shared<CountingPPTokenStream>();
+			PPTokenizer tokenizer(output);
+			auto begin = chrono::steady_clock::now();
+			tokenizer.processBlock(reinterpret_cast<const unsigned char*>(input.data()), input.size());
+			tokenizer.process(EndOfFile);
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+			cout << input.size() << "\t" << output->tokens << "\t" << seconds << "\t"
+			     << seconds * 1e9 / input.size() << "\t" << input.size() / seconds / (1 << 20) << endl;
+		}
+	}
+	catch (exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+}